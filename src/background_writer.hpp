@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Runs a write function on a thread of its own whenever asked to, so that
+// render threads never wait for images to be encoded or files to be written.
+// The write function snapshots whatever it needs from the live buffers into
+// its own, so rendering carries on while the snapshot is encoded. Requests
+// made while a write is in progress are coalesced into one more write once it
+// finishes.
+//
+// Requesting a write never takes a lock. A request which races with the
+// writer going to sleep can miss the wakeup, so the writer also checks for
+// requests every poll_interval.
+class background_writer {
+  static constexpr auto poll_interval = std::chrono::milliseconds(100);
+
+  std::function<void()> m_write;
+  std::atomic<bool> m_requested = false;
+  std::atomic<bool> m_stopping = false;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  // Started last, once everything it uses is initialised
+  std::thread m_thread;
+
+public:
+  explicit background_writer(std::function<void()> write)
+      : m_write(std::move(write)), m_thread([this]() { run(); }) {}
+  background_writer(const background_writer &) = delete;
+  background_writer &operator=(const background_writer &) = delete;
+  ~background_writer() { finish(); }
+
+  // Asks for a write, without waiting for it
+  inline void request() {
+    m_requested.store(true, std::memory_order_release);
+    m_condition.notify_one();
+  }
+
+  // Finishes any requested write and stops the thread, after which the write
+  // function is never called again
+  void finish() {
+    if (!m_thread.joinable())
+      return;
+    m_stopping.store(true, std::memory_order_release);
+    m_condition.notify_one();
+    m_thread.join();
+  }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+      m_condition.wait_for(lock, poll_interval, [this]() {
+        return m_requested.load(std::memory_order_acquire) ||
+               m_stopping.load(std::memory_order_acquire);
+      });
+      if (m_requested.exchange(false, std::memory_order_acq_rel)) {
+        lock.unlock();
+        m_write();
+        lock.lock();
+      } else if (m_stopping.load(std::memory_order_acquire)) {
+        return;
+      }
+    }
+  }
+};
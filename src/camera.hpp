@@ -2,6 +2,7 @@
 #pragma once
 
 #include "ray.hpp"
+#include "sampler.hpp"
 #include "util.hpp"
 
 #include <cmath>
@@ -15,6 +16,9 @@ struct camera {
   vec3 m_vertical;
   vec3 m_u, m_v, m_w;
   real m_lens_radius;
+  // The angle between rays through neighbouring pixels, near the centre of
+  // the image
+  real m_pixel_spread_angle;
 
   camera(const int image_width, const int image_height, const point3 &look_from,
          const point3 &look_at, const vec3 &up, const real vfov,
@@ -40,16 +44,19 @@ struct camera {
         m_origin - m_horizontal / two + m_vertical / two - focus_dist * m_w;
 
     m_lens_radius = aperture / two;
+    m_pixel_spread_angle = viewport_height / image_height;
   }
 
-  ray get_ray(const real s, const real t) const {
-    const vec3 rd = m_lens_radius * util::random_in_unit_disk();
+  ray get_ray(const real s, const real t, sampler &samples) const {
+    const auto [u1, u2] = samples.get_2d();
+    const vec3 rd = m_lens_radius * util::sample_unit_disk(u1, u2);
     const vec3 offset = m_u * rd.x + m_v * rd.y;
+    const real time = m_time0 + (m_time1 - m_time0) * samples.get_1d();
 
     return ray(m_origin + offset,
                m_upper_left_corner + s * m_horizontal - t * m_vertical -
                    m_origin - offset,
-               util::random_real(m_time0, m_time1));
+               time);
   }
 
   // Returns a deterministic ray, for testing
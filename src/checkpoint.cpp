@@ -0,0 +1,81 @@
+#include "checkpoint.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+constexpr char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '1'};
+
+struct checkpoint_header {
+  char magic[8];
+  int32_t real_size;
+  int32_t width, height;
+  int32_t tile_width, tile_height;
+};
+
+template <typename T>
+void read_array(std::ifstream &file, std::vector<T> &values) {
+  file.read(reinterpret_cast<char *>(values.data()),
+            values.size() * sizeof(T));
+}
+
+template <typename T>
+void write_array(std::ofstream &file, const std::vector<T> &values) {
+  file.write(reinterpret_cast<const char *>(values.data()),
+             values.size() * sizeof(T));
+}
+} // namespace
+
+bool render_checkpoint::read(const std::string_view &filename) {
+  std::ifstream file{std::string(filename), std::ios::binary};
+  if (!file)
+    return false;
+
+  checkpoint_header header;
+  file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!file || std::memcmp(header.magic, checkpoint_magic,
+                           sizeof(checkpoint_magic)) != 0)
+    throw std::runtime_error("Invalid checkpoint file");
+  if (header.real_size != sizeof(real))
+    throw std::runtime_error(
+        "Checkpoint was written with a different floating point precision");
+
+  *this = render_checkpoint(header.width, header.height, header.tile_width,
+                            header.tile_height);
+  read_array(file, m_framebuffer);
+  read_array(file, m_weights);
+  read_array(file, m_squared_luminances);
+  if (!file)
+    throw std::runtime_error("Checkpoint file is truncated");
+  return true;
+}
+
+void render_checkpoint::write(const std::string_view &filename) const {
+  const std::string temporary_filename = std::string(filename) + ".tmp";
+  {
+    std::ofstream file{temporary_filename, std::ios::binary};
+    checkpoint_header header;
+    std::memcpy(header.magic, checkpoint_magic, sizeof(checkpoint_magic));
+    header.real_size = sizeof(real);
+    header.width = m_width;
+    header.height = m_height;
+    header.tile_width = m_tile_width;
+    header.tile_height = m_tile_height;
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    write_array(file, m_framebuffer);
+    write_array(file, m_weights);
+    write_array(file, m_squared_luminances);
+    file.close();
+    if (!file) {
+      std::cerr << "Could not write checkpoint '" << temporary_filename << "'"
+                << std::endl;
+      return;
+    }
+  }
+  if (std::rename(temporary_filename.c_str(), std::string(filename).c_str()))
+    std::cerr << "Could not replace checkpoint '" << filename << "'"
+              << std::endl;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "colour.hpp"
+#include "util.hpp"
+
+#include <string>
+#include <vector>
+
+// Everything render accumulates, so that an interrupted render can carry on
+// where it left off. Passes are merged into whole tiles at a time, so every
+// pixel of a tile has the same weight, which is also the index of the tile's
+// next sample.
+//
+// The file is a short header followed by the raw arrays, in the precision of
+// real, so resuming gives the same image as never having stopped.
+struct render_checkpoint {
+  int m_width = 0, m_height = 0;
+  int m_tile_width = 0, m_tile_height = 0;
+  std::vector<colour> m_framebuffer;
+  std::vector<int> m_weights;
+  std::vector<real> m_squared_luminances;
+
+  render_checkpoint() = default;
+  render_checkpoint(const int width, const int height, const int tile_width,
+                    const int tile_height)
+      : m_width(width), m_height(height), m_tile_width(tile_width),
+        m_tile_height(tile_height), m_framebuffer(width * height),
+        m_weights(width * height), m_squared_luminances(width * height) {}
+
+  // Returns false if there is no file to read. Throws std::runtime_error if
+  // the file is not a checkpoint written with the same precision.
+  bool read(const std::string_view &filename);
+
+  // Writes to a temporary file first and then renames it, so that being
+  // interrupted part way through leaves the previous checkpoint intact
+  void write(const std::string_view &filename) const;
+};
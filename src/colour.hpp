@@ -3,6 +3,8 @@
 
 #include "util.hpp"
 
+#include <cstring>
+
 constexpr inline real gamma_correct_real(const real d) {
   constexpr real gamma = 2.2, gamma_exp = 1.0 / gamma;
   return pow(d, gamma_exp);
@@ -13,6 +15,70 @@ constexpr inline colour gamma_correct(const colour &c) {
                 gamma_correct_real(c[2]));
 }
 
+// The luminance of a linear sRGB colour
+constexpr inline real luminance(const colour &c) {
+  return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+}
+
 constexpr inline unsigned char to_byte(const real d) { return 255.0 * d; }
 
 constexpr inline real from_byte(const unsigned char c) { return c / 255.0; }
+
+// Converts to an IEEE half precision float, rounding to nearest even, with
+// anything too large for a half becoming infinity
+inline uint16_t to_half(const float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  const uint16_t sign = (bits >> 16) & 0x8000;
+  const uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude >= 0x7f800000)
+    return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+  if (magnitude >= 0x477ff000)
+    return sign | 0x7c00;
+  if (magnitude < 0x38800000) {
+    // Too small for a normal half, so the implicit leading 1 becomes part of
+    // a denormal's mantissa
+    if (magnitude < 0x33000000)
+      return sign;
+    const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+    const int shift = 126 - static_cast<int>(magnitude >> 23);
+    uint32_t result = mantissa >> shift;
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (result & 1)))
+      ++result;
+    return sign | result;
+  }
+  // Rebias the exponent and drop 13 bits of mantissa. Rounding up can carry
+  // into the exponent, which is still the right answer.
+  uint32_t result = (magnitude - 0x38000000) >> 13;
+  const uint32_t remainder = magnitude & 0x1fff;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (result & 1)))
+    ++result;
+  return sign | result;
+}
+
+inline float from_half(const uint16_t h) {
+  const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  const uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // Normalize a denormal
+    uint32_t float_exponent = 113;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      --float_exponent;
+    }
+    bits = sign | (float_exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
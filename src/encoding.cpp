@@ -0,0 +1,156 @@
+#include "encoding.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+inline float apply_tone_mapping(const float x, const tone_mapping mapping) {
+  if (mapping == tone_mapping::aces) {
+    constexpr float a = 2.51f, b = 0.03f, c = 2.43f, d = 0.59f, e = 0.14f;
+    const float y = std::max(x, 0.0f);
+    return std::clamp((y * (a * y + b)) / (y * (c * y + d) + e), 0.0f, 1.0f);
+  }
+  return std::clamp(x, 0.0f, 1.0f);
+}
+
+// The byte for a value in [0, 1]
+inline unsigned char encode_reference(const float x) {
+  return to_byte(gamma_correct_real(x));
+}
+
+// Values in [2^-20, 1] are split into buckets by their exponent and the top 7
+// bits of their mantissa. A bucket is never more than 1/128 wider than where
+// it starts, which is narrower than the gap between any two byte thresholds,
+// so each bucket holds at most one threshold. Anything below 2^-20 encodes
+// to 0.
+constexpr int bucket_shift = 23 - 7;
+constexpr int32_t first_bucket = 0x35800000 >> bucket_shift;
+constexpr int32_t last_bucket = 0x3f800000 >> bucket_shift;
+constexpr int num_buckets = last_bucket - first_bucket + 1;
+
+struct encoding_tables {
+  // The byte at the start of each bucket
+  std::array<int32_t, num_buckets> bucket_bytes;
+  // The smallest value which encodes to each byte. The entry past 255 is out
+  // of range, so that 255 never rounds up.
+  std::array<float, 257> thresholds;
+
+  encoding_tables() {
+    const auto from_bits = [](const uint32_t bits) {
+      float x;
+      std::memcpy(&x, &bits, sizeof(x));
+      return x;
+    };
+    // Positive floats are ordered like their bits, so each threshold can be
+    // found by bisecting on those
+    thresholds[0] = 0.0f;
+    for (int byte = 1; byte < 256; ++byte) {
+      uint32_t low = 0, high = 0x3f800000;
+      while (low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        if (encode_reference(from_bits(middle)) >= byte)
+          high = middle;
+        else
+          low = middle + 1;
+      }
+      thresholds[byte] = from_bits(low);
+    }
+    thresholds[256] = 2.0f;
+
+    for (int bucket = 0; bucket < num_buckets; ++bucket)
+      bucket_bytes[bucket] = encode_reference(
+          from_bits(static_cast<uint32_t>(first_bucket + bucket)
+                    << bucket_shift));
+  }
+};
+
+const encoding_tables &get_tables() {
+  static const encoding_tables tables;
+  return tables;
+}
+
+// The byte for a value in [0, 1]
+inline unsigned char encode_lookup(const encoding_tables &tables,
+                                   const float x) {
+  uint32_t bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  const int32_t bucket = std::clamp<int32_t>(
+      static_cast<int32_t>((bits & 0x7fffffff) >> bucket_shift) - first_bucket,
+      0, num_buckets - 1);
+  const int32_t byte = tables.bucket_bytes[bucket];
+  return byte + (x >= tables.thresholds[byte + 1]);
+}
+
+#ifdef __AVX2__
+inline __m256 load_floats(const real *values) {
+#if USE_FLOATS
+  return _mm256_loadu_ps(values);
+#else
+  return _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(values + 4)),
+                         _mm256_cvtpd_ps(_mm256_loadu_pd(values)));
+#endif // USE_FLOATS
+}
+
+// encode_lookup for 8 values at once, after tone mapping them
+inline void encode_lookup_8(const encoding_tables &tables, const real *values,
+                            unsigned char *bytes, const tone_mapping mapping) {
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  __m256 x = _mm256_max_ps(load_floats(values), zero);
+  if (mapping == tone_mapping::aces) {
+    const __m256 numerator = _mm256_mul_ps(
+        x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), x),
+                         _mm256_set1_ps(0.03f)));
+    const __m256 denominator = _mm256_add_ps(
+        _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), x),
+                                       _mm256_set1_ps(0.59f))),
+        _mm256_set1_ps(0.14f));
+    x = _mm256_max_ps(_mm256_div_ps(numerator, denominator), zero);
+  }
+  x = _mm256_min_ps(x, one);
+
+  // Clear the sign of -0, as in encode_lookup
+  const __m256i bits = _mm256_and_si256(_mm256_castps_si256(x),
+                                        _mm256_set1_epi32(0x7fffffff));
+  __m256i bucket = _mm256_sub_epi32(_mm256_srli_epi32(bits, bucket_shift),
+                                    _mm256_set1_epi32(first_bucket));
+  bucket = _mm256_min_epi32(_mm256_max_epi32(bucket, _mm256_setzero_si256()),
+                            _mm256_set1_epi32(num_buckets - 1));
+  __m256i byte = _mm256_i32gather_epi32(tables.bucket_bytes.data(), bucket, 4);
+  const __m256 next_threshold =
+      _mm256_i32gather_ps(tables.thresholds.data() + 1, byte, 4);
+  // All ones, or -1, where x reaches the next byte
+  byte = _mm256_sub_epi32(
+      byte, _mm256_castps_si256(_mm256_cmp_ps(x, next_threshold, _CMP_GE_OQ)));
+
+  const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(byte),
+                                         _mm256_extracti128_si256(byte, 1));
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(bytes),
+                   _mm_packus_epi16(words, words));
+}
+#endif // __AVX2__
+} // namespace
+
+void encode_bytes(const real *values, const size_t num_values,
+                  unsigned char *bytes, const tone_mapping mapping) {
+  const encoding_tables &tables = get_tables();
+  size_t idx = 0;
+#ifdef __AVX2__
+  for (; idx + 8 <= num_values; idx += 8)
+    encode_lookup_8(tables, values + idx, bytes + idx, mapping);
+#endif // __AVX2__
+  for (; idx < num_values; ++idx)
+    bytes[idx] = encode_lookup(
+        tables, apply_tone_mapping(static_cast<float>(values[idx]), mapping));
+}
+
+void encode_bytes_reference(const real *values, const size_t num_values,
+                            unsigned char *bytes, const tone_mapping mapping) {
+  for (size_t idx = 0; idx < num_values; ++idx)
+    bytes[idx] = encode_reference(
+        apply_tone_mapping(static_cast<float>(values[idx]), mapping));
+}
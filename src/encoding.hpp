@@ -0,0 +1,28 @@
+#pragma once
+
+#include "colour.hpp"
+#include "util.hpp"
+
+#include <cstddef>
+
+// How linear colours are brought into [0, 1] before gamma encoding
+enum class tone_mapping {
+  // Anything outside [0, 1] is clamped
+  clamp,
+  // Krzysztof Narkowicz's fit to the ACES filmic curve, which rolls off
+  // highlights instead of clipping them
+  aces,
+};
+
+// Gamma encodes num_values linear values, such as the components of an array
+// of colours, to bytes. Matches encode_bytes_reference exactly, but looks the
+// gamma curve up in a table instead of calling pow, and uses AVX2 when it is
+// compiled in.
+void encode_bytes(const real *values, const size_t num_values,
+                  unsigned char *bytes,
+                  const tone_mapping mapping = tone_mapping::clamp);
+
+// The straightforward version of encode_bytes, one pow per value
+void encode_bytes_reference(const real *values, const size_t num_values,
+                            unsigned char *bytes,
+                            const tone_mapping mapping = tone_mapping::clamp);
@@ -0,0 +1,112 @@
+
+#include "environment_light.hpp"
+#include "colour.hpp"
+#include "sphere.hpp"
+
+#include <algorithm>
+
+environment_light::environment_light(const std::string_view &filename)
+    : m_map(filename, false) {
+  const int width = m_map.width(), height = m_map.height();
+  if (m_map.empty())
+    return;
+
+  // Row r covers v in [1 - (r + 1) / height, 1 - r / height], so its centre
+  // is at theta = pi * (1 - (r + 0.5) / height)
+  m_pixel_weights.resize(width * height);
+  m_pixel_cdfs.resize(height * (width + 1));
+  m_row_cdf.resize(height + 1);
+  m_row_cdf[0] = 0.0;
+  for (int row = 0; row < height; ++row) {
+    const real theta = pi * (1.0 - (row + 0.5) / height);
+    const real sin_theta = std::sin(theta);
+    real *pixel_cdf = &m_pixel_cdfs[row * (width + 1)];
+    pixel_cdf[0] = 0.0;
+    for (int col = 0; col < width; ++col) {
+      const real weight =
+          std::max<real>(luminance(m_map.get(row, col)), 0.0) * sin_theta;
+      m_pixel_weights[row * width + col] = weight;
+      pixel_cdf[col + 1] = pixel_cdf[col] + weight;
+    }
+    const real row_weight = pixel_cdf[width];
+    m_row_cdf[row + 1] = m_row_cdf[row] + row_weight;
+    for (int col = 1; col <= width; ++col)
+      pixel_cdf[col] = row_weight > 0.0 ? pixel_cdf[col] / row_weight
+                                        : static_cast<real>(col) / width;
+  }
+  m_total_weight = m_row_cdf[height];
+  for (int row = 1; row <= height; ++row)
+    m_row_cdf[row] = m_total_weight > 0.0 ? m_row_cdf[row] / m_total_weight
+                                          : static_cast<real>(row) / height;
+}
+
+colour environment_light::emitted(const vec3 &direction) const {
+  real u, v;
+  sphere::get_sphere_uv(glm::normalize(direction), u, v);
+  return m_map.lookup(u, v, 0.0);
+}
+
+namespace {
+// Finds the bucket of a normalized cdf with num_buckets + 1 entries which
+// contains u, with output variable offset set to u's position within it
+inline int sample_cdf(const real *cdf, const int num_buckets, const real u,
+                      real &offset) {
+  const int bucket = std::clamp<int>(
+      std::upper_bound(cdf, cdf + num_buckets + 1, u) - cdf - 1, 0,
+      num_buckets - 1);
+  const real width = cdf[bucket + 1] - cdf[bucket];
+  offset = width > 0.0 ? std::clamp<real>((u - cdf[bucket]) / width, 0.0, 1.0)
+                       : 0.5;
+  return bucket;
+}
+} // namespace
+
+vec3 environment_light::sample(const real u1, const real u2, real &pdf) const {
+  const int width = m_map.width(), height = m_map.height();
+  if (!(m_total_weight > 0.0)) {
+    pdf = 0.0;
+    return vec3(0.0, 1.0, 0.0);
+  }
+
+  real row_offset, col_offset;
+  const int row = sample_cdf(m_row_cdf.data(), height, u1, row_offset);
+  const int col = sample_cdf(&m_pixel_cdfs[row * (width + 1)], width, u2,
+                             col_offset);
+
+  // Invert the mapping of sphere::get_sphere_uv
+  const real u = (col + col_offset) / width;
+  const real v = 1.0 - (row + row_offset) / height;
+  const real theta = v * pi, phi = 2.0 * pi * u;
+  const real sin_theta = std::sin(theta);
+  pdf = pixel_pdf(row, col, sin_theta);
+  return vec3(-std::cos(phi) * sin_theta, -std::cos(theta),
+              std::sin(phi) * sin_theta);
+}
+
+real environment_light::pdf(const vec3 &direction) const {
+  const int width = m_map.width(), height = m_map.height();
+  if (!(m_total_weight > 0.0))
+    return 0.0;
+
+  const vec3 unit_direction = glm::normalize(direction);
+  real u, v;
+  sphere::get_sphere_uv(unit_direction, u, v);
+  const int col = std::clamp(static_cast<int>(u * width), 0, width - 1);
+  const int row =
+      std::clamp(static_cast<int>((1.0 - v) * height), 0, height - 1);
+  const real sin_theta = std::sqrt(
+      std::max<real>(0.0, 1.0 - unit_direction.y * unit_direction.y));
+  return pixel_pdf(row, col, sin_theta);
+}
+
+real environment_light::pixel_pdf(const int row, const int col,
+                                  const real sin_theta) const {
+  if (!(sin_theta > 0.0))
+    return 0.0;
+  // The pixel's density over the unit square of uv's, divided by the
+  // Jacobian of the mapping from uv's to directions
+  const int width = m_map.width(), height = m_map.height();
+  const real uv_pdf = m_pixel_weights[row * width + col] *
+                      static_cast<real>(width) * height / m_total_weight;
+  return uv_pdf / (2.0 * pi * pi * sin_theta);
+}
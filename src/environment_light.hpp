@@ -0,0 +1,39 @@
+#pragma once
+
+#include "mipmap.hpp"
+#include "util.hpp"
+
+#include <string>
+#include <vector>
+
+// An image surrounding the scene at infinity, which lights every ray that
+// escapes it. Directions map to uv's as in sphere::get_sphere_uv, and
+// directions are importance sampled by luminance: a row of the image is
+// chosen from a marginal distribution, then a pixel from that row's
+// conditional distribution, with rows weighted by the solid angle they cover.
+struct environment_light {
+  mipmap m_map;
+  // The running sums of the rows' weights, and of each row's pixel weights,
+  // each normalized to end at 1
+  std::vector<real> m_row_cdf;
+  std::vector<real> m_pixel_cdfs;
+  // The total weight, and the weight of each pixel
+  real m_total_weight = 0.0;
+  std::vector<real> m_pixel_weights;
+
+  explicit environment_light(const std::string_view &filename);
+
+  colour emitted(const vec3 &direction) const;
+
+  // Chooses a unit direction towards the environment, with output variable
+  // pdf set to its density per unit solid angle
+  vec3 sample(const real u1, const real u2, real &pdf) const;
+
+  // The density per unit solid angle with which sample picks direction
+  real pdf(const vec3 &direction) const;
+
+private:
+  // The density of picking the pixel at (row, col) per unit solid angle, at a
+  // point of it with the given sin(theta)
+  real pixel_pdf(const int row, const int col, const real sin_theta) const;
+};
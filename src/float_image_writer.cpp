@@ -0,0 +1,168 @@
+#include "float_image_writer.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+
+namespace {
+bool has_extension(const std::string_view &filename,
+                   const std::string_view &extension) {
+  return filename.size() >= extension.size() &&
+         filename.substr(filename.size() - extension.size()) == extension;
+}
+
+// Both formats are little endian
+template <typename T>
+void append_integer(std::vector<char> &bytes, const T value) {
+  static_assert(std::is_integral_v<T>);
+  for (size_t idx = 0; idx < sizeof(T); ++idx)
+    bytes.push_back(static_cast<char>((value >> (8 * idx)) & 0xff));
+}
+
+void append_float(std::vector<char> &bytes, const float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  append_integer(bytes, bits);
+}
+
+void append_string(std::vector<char> &bytes, const std::string_view &text) {
+  bytes.insert(bytes.end(), text.begin(), text.end());
+  bytes.push_back('\0');
+}
+
+// An EXR header attribute is its name, its type, its size and its value
+void append_attribute(std::vector<char> &header, const std::string_view &name,
+                      const std::string_view &type,
+                      const std::vector<char> &value) {
+  append_string(header, name);
+  append_string(header, type);
+  append_integer(header, static_cast<int32_t>(value.size()));
+  header.insert(header.end(), value.begin(), value.end());
+}
+
+// EXR channels are stored in alphabetical order
+constexpr char exr_channels[3] = {'B', 'G', 'R'};
+constexpr int exr_channel_components[3] = {2, 1, 0};
+constexpr int32_t exr_half = 1;
+} // namespace
+
+float_image_writer::float_image_writer(const std::string_view &filename,
+                                       const int width, const int height)
+    : m_file(std::string(filename), std::ios::binary | std::ios::trunc),
+      m_width(width), m_height(height) {
+  if (!m_file)
+    throw std::runtime_error("Could not open '" + std::string(filename) +
+                             "' for writing");
+  if (has_extension(filename, ".pfm")) {
+    m_format = file_format::pfm;
+    write_pfm_header();
+  } else if (has_extension(filename, ".exr")) {
+    m_format = file_format::exr;
+    write_exr_header();
+  } else {
+    throw std::runtime_error("Unsupported float image format: '" +
+                             std::string(filename) + "'");
+  }
+
+  // Lay out every row up front, so that the file is valid however many rows
+  // are written
+  const std::vector<colour> black_row(m_width, colour(0.0));
+  for (int row = 0; row < m_height; ++row)
+    write_rows(row, 1, black_row.data());
+}
+
+bool float_image_writer::supports(const std::string_view &filename) {
+  return has_extension(filename, ".pfm") || has_extension(filename, ".exr");
+}
+
+void float_image_writer::write_pfm_header() {
+  // A negative scale means little endian
+  std::stringstream header;
+  header << "PF\n" << m_width << " " << m_height << "\n-1.0\n";
+  const std::string text = header.str();
+  m_file.write(text.data(), text.size());
+  m_data_offset = text.size();
+  m_row_stride = static_cast<std::streamoff>(m_width) * 3 * sizeof(float);
+}
+
+void float_image_writer::write_exr_header() {
+  std::vector<char> header;
+  append_integer(header, static_cast<int32_t>(20000630));
+  // Version 2, single part scanline image
+  append_integer(header, static_cast<int32_t>(2));
+
+  std::vector<char> channels;
+  for (const char channel : exr_channels) {
+    append_string(channels, std::string_view(&channel, 1));
+    append_integer(channels, exr_half);
+    // pLinear and three reserved bytes
+    append_integer(channels, static_cast<int32_t>(0));
+    // x and y sampling
+    append_integer(channels, static_cast<int32_t>(1));
+    append_integer(channels, static_cast<int32_t>(1));
+  }
+  channels.push_back('\0');
+  append_attribute(header, "channels", "chlist", channels);
+  // No compression
+  append_attribute(header, "compression", "compression", {0});
+  std::vector<char> window;
+  append_integer(window, static_cast<int32_t>(0));
+  append_integer(window, static_cast<int32_t>(0));
+  append_integer(window, static_cast<int32_t>(m_width - 1));
+  append_integer(window, static_cast<int32_t>(m_height - 1));
+  append_attribute(header, "dataWindow", "box2i", window);
+  append_attribute(header, "displayWindow", "box2i", window);
+  // Increasing y
+  append_attribute(header, "lineOrder", "lineOrder", {0});
+  std::vector<char> one;
+  append_float(one, 1.0f);
+  append_attribute(header, "pixelAspectRatio", "float", one);
+  std::vector<char> centre;
+  append_float(centre, 0.0f);
+  append_float(centre, 0.0f);
+  append_attribute(header, "screenWindowCenter", "v2f", centre);
+  append_attribute(header, "screenWindowWidth", "float", one);
+  header.push_back('\0');
+
+  // Each row is a block of its own, made of its y coordinate, its size, and
+  // then each channel's values for the whole row
+  const int32_t row_bytes = m_width * 3 * sizeof(uint16_t);
+  m_row_stride = 2 * sizeof(int32_t) + row_bytes;
+  m_data_offset = header.size() + m_height * sizeof(uint64_t);
+  for (int row = 0; row < m_height; ++row)
+    append_integer(header,
+                   static_cast<uint64_t>(m_data_offset + row * m_row_stride));
+  m_file.write(header.data(), header.size());
+}
+
+void float_image_writer::write_rows(const int first_row, const int num_rows,
+                                    const colour *pixels) {
+  for (int row = first_row; row < first_row + num_rows; ++row) {
+    const colour *row_pixels = pixels + (row - first_row) * m_width;
+    m_row_buffer.clear();
+    std::streamoff offset;
+    if (m_format == file_format::pfm) {
+      // PFM rows go from the bottom of the image to the top
+      offset = m_data_offset + (m_height - 1 - row) * m_row_stride;
+      for (int col = 0; col < m_width; ++col)
+        for (int component = 0; component < 3; ++component)
+          append_float(m_row_buffer,
+                       static_cast<float>(row_pixels[col][component]));
+    } else {
+      offset = m_data_offset + row * m_row_stride;
+      append_integer(m_row_buffer, static_cast<int32_t>(row));
+      append_integer(m_row_buffer,
+                     static_cast<int32_t>(m_width * 3 * sizeof(uint16_t)));
+      for (const int component : exr_channel_components)
+        for (int col = 0; col < m_width; ++col)
+          append_integer(m_row_buffer, to_half(static_cast<float>(
+                                           row_pixels[col][component])));
+    }
+    m_file.seekp(offset);
+    m_file.write(m_row_buffer.data(), m_row_buffer.size());
+  }
+  if (!m_file)
+    throw std::runtime_error("Could not write float image rows");
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "colour.hpp"
+#include "util.hpp"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Writes linear, unclamped colours to a PFM file, as 32 bit floats, or to an
+// uncompressed scanline OpenEXR file, as half floats. The format is chosen by
+// the filename's extension.
+//
+// Every row has a fixed place in both formats, so rows can be written in any
+// order as soon as they are finished, and only the rows in flight need to be
+// held in memory. Rows which are never written are left black.
+class float_image_writer {
+public:
+  enum class file_format { pfm, exr };
+
+  float_image_writer(const std::string_view &filename, const int width,
+                     const int height);
+
+  // Whether filename has an extension this class can write
+  static bool supports(const std::string_view &filename);
+
+  // Writes num_rows rows of width pixels each, starting at first_row, where
+  // row 0 is the top of the image
+  void write_rows(const int first_row, const int num_rows,
+                  const colour *pixels);
+
+private:
+  std::ofstream m_file;
+  file_format m_format;
+  int m_width, m_height;
+  // Where the first row's data starts, and how far apart rows are
+  std::streamoff m_data_offset, m_row_stride;
+  std::vector<char> m_row_buffer;
+
+  void write_pfm_header();
+  void write_exr_header();
+};
@@ -1,6 +1,8 @@
 
 #include "image.hpp"
 #include "colour.hpp"
+#include "encoding.hpp"
+#include "float_image_writer.hpp"
 #include "stb.hpp"
 #include "util.hpp"
 
@@ -8,7 +10,48 @@
 #include <string>
 #include <vector>
 
+namespace {
+// Reads a little endian PFM file, such as float_image_writer writes, which
+// stb_image can't. Its rows go from the bottom of the image to the top.
+bool read_pfm(const std::string_view &filename, int &width, int &height,
+              std::vector<colour> &pixels) {
+  std::ifstream file{std::string(filename), std::ios::binary};
+  std::string magic;
+  float scale = 0.0f;
+  file >> magic >> width >> height >> scale;
+  // A single whitespace character separates the header from the data
+  file.get();
+  if (!file || magic != "PF" || width <= 0 || height <= 0 || scale >= 0.0f)
+    return false;
+
+  std::vector<float> row(3 * static_cast<size_t>(width));
+  pixels.resize(static_cast<size_t>(width) * height);
+  for (int row_idx = height - 1; row_idx >= 0; --row_idx) {
+    file.read(reinterpret_cast<char *>(row.data()),
+              row.size() * sizeof(float));
+    if (!file)
+      return false;
+    for (int col = 0; col < width; ++col)
+      pixels[static_cast<size_t>(row_idx) * width + col] =
+          colour(row[3 * col + 0], row[3 * col + 1], row[3 * col + 2]);
+  }
+  return true;
+}
+} // namespace
+
 image::image(const std::string_view &filename) {
+  const std::string_view pfm_extension = ".pfm";
+  if (filename.size() >= pfm_extension.size() &&
+      filename.substr(filename.size() - pfm_extension.size()) ==
+          pfm_extension) {
+    if (!read_pfm(filename, m_width, m_height, m_pixels)) {
+      std::cerr << "ERROR: Could not load PFM file '" << filename << "'"
+                << std::endl;
+      m_pixels.clear();
+    }
+    return;
+  }
+
   int components_per_pixel = bytes_per_pixel;
   float *loaded_data = stbi_loadf(filename.data(), &m_width, &m_height,
                                   &components_per_pixel, components_per_pixel);
@@ -29,17 +72,14 @@ image::image(const std::string_view &filename) {
   stbi_image_free(loaded_data);
 }
 
-void image::write_png(const std::string_view &filename) {
+void image::write_png(const std::string_view &filename,
+                      const tone_mapping mapping) {
+  static_assert(sizeof(colour) == bytes_per_pixel * sizeof(real));
   std::vector<unsigned char> gamma_corrected_data(bytes_per_pixel * m_width *
                                                   m_height);
-  for (int i = 0; i < m_width * m_height; ++i) {
-    gamma_corrected_data[3 * i + 0] = to_byte(
-        gamma_correct_real(std::clamp<float>(m_pixels[i][0], 0.0, 1.0)));
-    gamma_corrected_data[3 * i + 1] = to_byte(
-        gamma_correct_real(std::clamp<float>(m_pixels[i][1], 0.0, 1.0)));
-    gamma_corrected_data[3 * i + 2] = to_byte(
-        gamma_correct_real(std::clamp<float>(m_pixels[i][2], 0.0, 1.0)));
-  }
+  encode_bytes(reinterpret_cast<const real *>(m_pixels.data()),
+               bytes_per_pixel * m_pixels.size(), gamma_corrected_data.data(),
+               mapping);
 
   const int result =
       stbi_write_png(filename.data(), m_width, m_height, bytes_per_pixel,
@@ -49,3 +89,15 @@ void image::write_png(const std::string_view &filename) {
     assert(false);
   }
 }
+
+void image::write_float(const std::string_view &filename) const {
+  float_image_writer writer(filename, m_width, m_height);
+  writer.write_rows(0, m_height, m_pixels.data());
+}
+
+void image::write(const std::string_view &filename) {
+  if (float_image_writer::supports(filename))
+    write_float(filename);
+  else
+    write_png(filename);
+}
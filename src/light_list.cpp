@@ -0,0 +1,322 @@
+
+#include "light_list.hpp"
+#include "colour.hpp"
+#include "sphere.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+light_list::emitter light_list::emitter::triangle(
+    const point3 &p0, const vec3 &edge1, const vec3 &edge2, const vec3 &uv0,
+    const vec3 &uv1, const vec3 &uv2, material *mat) {
+  emitter result = parallelogram(p0, edge1, edge2, uv0, uv1, uv2, mat);
+  result.shape = TRIANGLE;
+  return result;
+}
+
+light_list::emitter light_list::emitter::parallelogram(
+    const point3 &p0, const vec3 &edge1, const vec3 &edge2, const vec3 &uv0,
+    const vec3 &uv1, const vec3 &uv2, material *mat) {
+  emitter result;
+  result.shape = PARALLELOGRAM;
+  result.p0 = p0;
+  result.edge1 = edge1;
+  result.edge2 = edge2;
+  result.uv0 = uv0;
+  result.uv1 = uv1;
+  result.uv2 = uv2;
+  result.centre1 = p0;
+  result.time0 = 0.0;
+  result.time1 = 1.0;
+  result.radius = 0.0;
+  result.mat_ptr = mat;
+  result.area = 0.0;
+  return result;
+}
+
+light_list::emitter light_list::emitter::sphere(const point3 &centre0,
+                                                const point3 &centre1,
+                                                const real time0,
+                                                const real time1,
+                                                const real radius,
+                                                material *mat) {
+  emitter result = parallelogram(centre0, vec3(0.0), vec3(0.0), vec3(0.0),
+                                 vec3(0.0), vec3(0.0), mat);
+  result.shape = SPHERE;
+  result.centre1 = centre1;
+  result.time0 = time0;
+  result.time1 = time1;
+  result.radius = radius;
+  return result;
+}
+
+light_list::light_list(const hittable &world) {
+  std::vector<hit_record::path_entry> outer_path;
+  world.gather_lights(*this, mat4(1.0), outer_path);
+
+  // Choose lights in proportion to a rough estimate of their power: their
+  // area times the luminance of their emission at one point. Textured lights
+  // which happen to be black there still get a small share.
+  std::vector<real> weights(m_emitters.size());
+  real total_weight = 0.0;
+  for (size_t i = 0; i < m_emitters.size(); ++i) {
+    const emitter &light = m_emitters[i];
+    point3 p = light.p0;
+    vec3 uv(0.5, 0.5, 0.0);
+    if (light.shape != emitter::SPHERE) {
+      const real b = light.shape == emitter::TRIANGLE ? 1.0 / 3.0 : 0.5;
+      p += b * (light.edge1 + light.edge2);
+      uv = light.uv0 + b * (light.uv1 - light.uv0 + light.uv2 - light.uv0);
+    }
+    const real lum = luminance(light.mat_ptr->emitted(uv[0], uv[1], p));
+    weights[i] = light.area * std::max<real>(lum, 1e-3);
+    total_weight += weights[i];
+  }
+
+  // The environment's power can't be compared with the emitters' areas, so it
+  // gets a fixed share of the samples
+  if (m_environment)
+    m_environment_probability = m_emitters.empty() ? 1.0 : 0.5;
+  const real emitter_probability = 1.0 - m_environment_probability;
+
+  m_probabilities.resize(m_emitters.size());
+  m_cdf.resize(m_emitters.size());
+  real running_total = 0.0;
+  for (size_t i = 0; i < m_emitters.size(); ++i) {
+    m_probabilities[i] = emitter_probability * weights[i] / total_weight;
+    running_total += weights[i];
+    m_cdf[i] = running_total / total_weight;
+  }
+
+  std::cout << "Gathered " << m_emitters.size() << " lights"
+            << (m_environment ? " and an environment" : "") << std::endl;
+}
+
+light_list::light_key
+light_list::make_key(const hittable *object, const uint32_t id,
+                     const std::vector<hit_record::path_entry> &outer) {
+  // Paths in a hit_record start at the primitive and end with the outermost
+  // object
+  light_key result;
+  result.path[0] = {object, id};
+  result.path_length = 1;
+  for (auto it = outer.rbegin(); it != outer.rend(); ++it)
+    result.path[result.path_length++] = *it;
+  return result;
+}
+
+void light_list::add(const emitter &light, const hittable *object,
+                     const uint32_t id, const mat4 &model_matrix,
+                     const std::vector<hit_record::path_entry> &outer_path) {
+  assert(outer_path.size() < hit_record::max_path_length);
+  emitter result = light;
+  if (light.shape == emitter::SPHERE) {
+    // Only translated and uniformly scaled spheres stay spheres with the same
+    // uv mapping, so any other transform leaves the light to be found by
+    // chance
+    const real scale = model_matrix[0][0];
+    for (int col = 0; col < 3; ++col)
+      for (int row = 0; row < 3; ++row)
+        if (std::abs(model_matrix[col][row] - (row == col ? scale : 0.0)) >
+            eps * std::abs(scale)) {
+          std::cerr << "WARNING: Cannot sample a rotated or non-uniformly "
+                       "scaled spherical light"
+                    << std::endl;
+          return;
+        }
+    result.p0 = model_matrix * vec4(light.p0, 1.0);
+    result.centre1 = model_matrix * vec4(light.centre1, 1.0);
+    result.radius = std::abs(scale) * light.radius;
+    result.area = 4.0 * pi * result.radius * result.radius;
+  } else {
+    result.p0 = model_matrix * vec4(light.p0, 1.0);
+    result.edge1 = model_matrix * vec4(light.edge1, 0.0);
+    result.edge2 = model_matrix * vec4(light.edge2, 0.0);
+    result.area = glm::length(glm::cross(result.edge1, result.edge2));
+    if (light.shape == emitter::TRIANGLE)
+      result.area /= 2.0;
+  }
+  if (!(result.area > 0.0))
+    return;
+
+  m_indices[make_key(object, id, outer_path)] = m_emitters.size();
+  m_emitters.push_back(result);
+}
+
+void light_list::add_instance(
+    const light_list &object_lights, const mat4 &model_matrix,
+    const std::vector<hit_record::path_entry> &outer_path) {
+  // Keep the lights in the order they were gathered in
+  std::vector<const light_key *> keys(object_lights.m_emitters.size());
+  for (const auto &[key, idx] : object_lights.m_indices)
+    keys[idx] = &key;
+
+  std::vector<hit_record::path_entry> full_outer_path;
+  for (size_t idx = 0; idx < keys.size(); ++idx) {
+    // The key's path runs from the primitive outwards, while outer paths run
+    // from the outermost object inwards
+    const light_key &key = *keys[idx];
+    full_outer_path = outer_path;
+    for (size_t entry = key.path_length - 1; entry > 0; --entry)
+      full_outer_path.push_back(key.path[entry]);
+    add(object_lights.m_emitters[idx], key.path[0].object, key.path[0].id,
+        model_matrix, full_outer_path);
+  }
+}
+
+namespace {
+// The solid angle density of sampling uniformly within the cone of
+// directions towards a sphere, from a point squared_distance from its centre
+inline real cone_pdf(const real squared_distance, const real squared_radius) {
+  const real sin2_max = squared_radius / squared_distance;
+  // For tiny cones, 1 - cos would cancel catastrophically, so use its Taylor
+  // expansion instead
+  const real one_minus_cos_max =
+      sin2_max < 0.00068523 ? sin2_max / 2.0 : 1.0 - std::sqrt(1.0 - sin2_max);
+  return 1.0 / (2.0 * pi * one_minus_cos_max);
+}
+
+// The solid angle density of sampling p uniformly by area from ref
+inline real area_to_solid_angle_pdf(const point3 &ref, const point3 &p,
+                                    const vec3 &normal, const real area) {
+  const vec3 to_light = p - ref;
+  const real squared_distance = glm::dot(to_light, to_light);
+  const real cos_theta =
+      std::abs(glm::dot(normal, to_light)) / std::sqrt(squared_distance);
+  if (!(cos_theta > 0.0))
+    return 0.0;
+  return squared_distance / (cos_theta * area);
+}
+} // namespace
+
+bool light_list::sample(const point3 &ref, const real time, sampler &samples,
+                        light_sample &result) const {
+  if (empty())
+    return false;
+  real u = samples.get_1d();
+  const auto [u1, u2] = samples.get_2d();
+
+  if (u < m_environment_probability) {
+    result.direction = m_environment->sample(u1, u2, result.pdf);
+    if (!(result.pdf > 0.0))
+      return false;
+    result.pdf *= m_environment_probability;
+    result.p = ref + result.direction;
+    result.p_error = vec3(0.0);
+    result.normal = -result.direction;
+    result.emitted = m_environment->emitted(result.direction);
+    result.at_infinity = true;
+    return true;
+  }
+  if (m_emitters.empty())
+    return false;
+  u = (u - m_environment_probability) / (1.0 - m_environment_probability);
+
+  const size_t idx =
+      std::min<size_t>(std::upper_bound(m_cdf.begin(), m_cdf.end(), u) -
+                           m_cdf.begin(),
+                       m_emitters.size() - 1);
+  const emitter &light = m_emitters[idx];
+
+  vec3 uv;
+  if (light.shape == emitter::SPHERE) {
+    const point3 centre = light.centre(time);
+    const real squared_radius = light.radius * light.radius;
+    const vec3 to_ref = ref - centre;
+    const real squared_distance = glm::dot(to_ref, to_ref);
+    if (squared_distance <= squared_radius) {
+      // From inside, sample the whole sphere uniformly by area
+      result.normal = util::sample_unit_vector(u1, u2);
+      result.p = centre + light.radius * result.normal;
+      result.pdf =
+          area_to_solid_angle_pdf(ref, result.p, result.normal, light.area);
+    } else {
+      // From outside, sample the cone of directions which see the sphere
+      // ("Sampling Light Sources", pbrt-v4), and find the point on the
+      // sphere that the direction reaches first
+      const real sin2_max = squared_radius / squared_distance;
+      const real sin_max = std::sqrt(sin2_max);
+      const real cos_max = std::sqrt(std::max<real>(0.0, 1.0 - sin2_max));
+      real cos_theta = (cos_max - 1.0) * u1 + 1.0;
+      real sin2_theta = 1.0 - cos_theta * cos_theta;
+      if (sin2_max < 0.00068523) {
+        sin2_theta = sin2_max * u1;
+        cos_theta = std::sqrt(1.0 - sin2_theta);
+      }
+      const real cos_alpha =
+          sin2_theta / sin_max +
+          cos_theta *
+              std::sqrt(std::max<real>(0.0, 1.0 - sin2_theta / sin2_max));
+      const real sin_alpha =
+          std::sqrt(std::max<real>(0.0, 1.0 - cos_alpha * cos_alpha));
+      const real phi = 2.0 * pi * u2;
+
+      const vec3 w = to_ref / std::sqrt(squared_distance);
+      vec3 b1, b2;
+      util::orthonormal_basis(w, b1, b2);
+      result.normal = glm::normalize(sin_alpha * std::cos(phi) * b1 +
+                                     sin_alpha * std::sin(phi) * b2 +
+                                     cos_alpha * w);
+      result.p = centre + light.radius * result.normal;
+      result.pdf = cone_pdf(squared_distance, squared_radius);
+    }
+    result.p_error = util::gamma(6) * (glm::abs(light.radius * result.normal) +
+                                       glm::abs(centre));
+    sphere::get_sphere_uv(result.normal, uv[0], uv[1]);
+  } else {
+    real u_param = u1, v_param = u2;
+    if (light.shape == emitter::TRIANGLE) {
+      const real su1 = std::sqrt(u1);
+      u_param = su1 * (1.0 - u2);
+      v_param = su1 * u2;
+    }
+    result.p = light.p0 + u_param * light.edge1 + v_param * light.edge2;
+    result.p_error = util::gamma(7) * (real(3.0) * glm::abs(light.p0) +
+                                       glm::abs(light.edge1) +
+                                       glm::abs(light.edge2));
+    result.normal = glm::normalize(glm::cross(light.edge1, light.edge2));
+    result.pdf =
+        area_to_solid_angle_pdf(ref, result.p, result.normal, light.area);
+    uv = light.uv0 + u_param * (light.uv1 - light.uv0) +
+         v_param * (light.uv2 - light.uv0);
+  }
+
+  if (!(result.pdf > 0.0))
+    return false;
+  result.pdf *= m_probabilities[idx];
+  result.direction = glm::normalize(result.p - ref);
+  result.emitted = light.mat_ptr->emitted(uv[0], uv[1], result.p);
+  result.at_infinity = false;
+  return true;
+}
+
+real light_list::pdf(const point3 &ref, const ray &r,
+                     const hit_record &rec) const {
+  if (m_emitters.empty())
+    return 0.0;
+  light_key key;
+  key.path_length = rec.path_length;
+  std::copy(rec.path.begin(), rec.path.begin() + rec.path_length,
+            key.path.begin());
+  const auto it = m_indices.find(key);
+  if (it == m_indices.end())
+    return 0.0;
+
+  const emitter &light = m_emitters[it->second];
+  const real probability = m_probabilities[it->second];
+  if (light.shape == emitter::SPHERE) {
+    const vec3 to_ref = ref - light.centre(r.time);
+    const real squared_distance = glm::dot(to_ref, to_ref);
+    const real squared_radius = light.radius * light.radius;
+    if (squared_distance > squared_radius)
+      return probability * cone_pdf(squared_distance, squared_radius);
+  }
+  return probability * area_to_solid_angle_pdf(ref, rec.p, rec.geometric_normal,
+                                               light.area);
+}
+
+real light_list::environment_pdf(const vec3 &direction) const {
+  if (!m_environment)
+    return 0.0;
+  return m_environment_probability * m_environment->pdf(direction);
+}
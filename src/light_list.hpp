@@ -0,0 +1,152 @@
+#pragma once
+
+#include "environment_light.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "sampler.hpp"
+#include "util.hpp"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// The emitting primitives of a scene, gathered once through
+// hittable::gather_lights so that paths can sample them directly. Each light
+// is identified by the path a hit_record would have for it, so that a path
+// which hits a light by chance can tell how likely light sampling was to
+// find the same point. An environment_light, if the scene has one, is
+// sampled alongside them.
+class light_list {
+public:
+  struct emitter {
+    enum shape_type { TRIANGLE, PARALLELOGRAM, SPHERE };
+
+    shape_type shape;
+    // Triangles and parallelograms are p0 + u * edge1 + v * edge2, with uv's
+    // interpolated the same way. Spheres are centred at p0 at time0, and move
+    // linearly to centre1 at time1.
+    point3 p0;
+    vec3 edge1, edge2;
+    vec3 uv0, uv1, uv2;
+    point3 centre1;
+    real time0, time1;
+    real radius;
+    material *mat_ptr;
+    real area;
+
+    static emitter triangle(const point3 &p0, const vec3 &edge1,
+                            const vec3 &edge2, const vec3 &uv0,
+                            const vec3 &uv1, const vec3 &uv2, material *mat);
+    static emitter parallelogram(const point3 &p0, const vec3 &edge1,
+                                 const vec3 &edge2, const vec3 &uv0,
+                                 const vec3 &uv1, const vec3 &uv2,
+                                 material *mat);
+    static emitter sphere(const point3 &centre0, const point3 &centre1,
+                          const real time0, const real time1,
+                          const real radius, material *mat);
+
+    inline point3 centre(const real time) const {
+      const real t = (time - time0) / (time1 - time0);
+      return (real(1.0) - t) * p0 + t * centre1;
+    }
+  };
+
+  struct light_sample {
+    point3 p;
+    vec3 p_error;
+    vec3 normal;    // The unit geometric normal
+    vec3 direction; // The unit direction from the reference point
+    colour emitted;
+    real pdf; // Per unit solid angle at the reference point
+    // Set for the environment, which has no point p to aim at
+    bool at_infinity;
+  };
+
+  std::vector<emitter> m_emitters;
+  // The probability of choosing each emitter, and their running sums
+  std::vector<real> m_probabilities;
+  std::vector<real> m_cdf;
+  std::shared_ptr<environment_light> m_environment;
+  real m_environment_probability = 0.0;
+
+private:
+  struct light_key {
+    std::array<hit_record::path_entry, hit_record::max_path_length> path = {};
+    size_t path_length = 0;
+
+    bool operator==(const light_key &other) const {
+      if (path_length != other.path_length)
+        return false;
+      for (size_t i = 0; i < path_length; ++i)
+        if (path[i].object != other.path[i].object ||
+            path[i].id != other.path[i].id)
+          return false;
+      return true;
+    }
+  };
+
+  struct light_key_hash {
+    size_t operator()(const light_key &key) const {
+      uint64_t result = key.path_length;
+      for (size_t i = 0; i < key.path_length; ++i) {
+        result = rng::mix(result ^ reinterpret_cast<uintptr_t>(
+                                       key.path[i].object));
+        result = rng::mix(result ^ key.path[i].id);
+      }
+      return result;
+    }
+  };
+
+  std::unordered_map<light_key, uint32_t, light_key_hash> m_indices;
+
+public:
+  light_list() = default;
+  explicit light_list(const hittable &world);
+
+  inline bool empty() const { return m_emitters.empty() && !m_environment; }
+  inline size_t size() const {
+    return m_emitters.size() + (m_environment ? 1 : 0);
+  }
+  inline const environment_light *environment() const {
+    return m_environment.get();
+  }
+
+  // Called by a hittable_list from gather_lights with its background
+  inline void
+  set_environment(const std::shared_ptr<environment_light> &environment) {
+    m_environment = environment;
+  }
+
+  // Called by a primitive from gather_lights, with its object-space shape and
+  // the id it passes to hit_record::set_hit
+  void add(const emitter &light, const hittable *object, const uint32_t id,
+           const mat4 &model_matrix,
+           const std::vector<hit_record::path_entry> &outer_path);
+
+  // Adds every light in object_lights, which were gathered from an object in
+  // its own space with an empty outer path, for one instance of that object
+  // placed by model_matrix. Objects with many instances gather their lights
+  // once and add them through this, rather than visiting every primitive
+  // again per instance.
+  void add_instance(const light_list &object_lights, const mat4 &model_matrix,
+                    const std::vector<hit_record::path_entry> &outer_path);
+
+  // Chooses a light and a point on it to illuminate ref at the given time.
+  // Returns false if there is nothing to sample.
+  bool sample(const point3 &ref, const real time, sampler &samples,
+              light_sample &result) const;
+
+  // The density with which sample picks the point rec, found along r from
+  // ref, or 0 if that point is not on a light in this list
+  real pdf(const point3 &ref, const ray &r, const hit_record &rec) const;
+
+  // The density with which sample picks direction towards the environment,
+  // for a ray which escapes the scene
+  real environment_pdf(const vec3 &direction) const;
+
+private:
+  static light_key make_key(const hittable *object, const uint32_t id,
+                            const std::vector<hit_record::path_entry> &outer);
+};
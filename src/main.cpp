@@ -1,44 +1,176 @@
 
+#include "background_writer.hpp"
 #include "material_manager.hpp"
+#include "sampler.hpp"
+#include "tile_scheduler.hpp"
 #include "util.hpp"
 
+#include "checkpoint.hpp"
 #include "colour.hpp"
+#include "encoding.hpp"
+#include "float_image_writer.hpp"
 #include "image.hpp"
+#include "light_list.hpp"
 #include "scenes/all_scenes.hpp"
 
 #include <atomic>
 #include <iostream>
 #include <mutex>
-#include <queue>
+#include <numeric>
+#include <stdexcept>
 #include <thread>
 
-__attribute__((hot)) colour
-ray_colour(const ray &r, const hittable &world, const int depth,
-           const colour &contribution = colour(1.0)) {
-  if (depth <= 0 || glm::length(contribution) < 1e-12) {
-    // static std::atomic<int> early_exits = 0;
-    // static int last_update = 0;
-    // early_exits += depth;
-    // if (early_exits >= last_update + 1000000) {
-    //   last_update = early_exits;
-    //   std::cout << early_exits << " early exits" << std::endl;
-    // }
+// Paths are never longer than this, unless render is told otherwise
+constexpr int default_max_depth = 100;
+// Paths with this many bounces become candidates for Russian roulette
+constexpr int russian_roulette_depth = 3;
+// Even bright paths are terminated with at least this probability, so that
+// paths trapped between mirrors end
+constexpr real min_termination_probability = 0.05;
+// Shadow rays stop this fraction of the way short of the light
+constexpr real shadow_epsilon = 1e-4;
+
+// Settings for spending samples where the image is still noisy. By default,
+// every pixel gets exactly the requested number of samples.
+struct adaptive_settings {
+  // Tiles stop being sampled once the relative standard error of their
+  // pixels' luminance falls below this, or never if it is 0
+  real error_target = 0.0;
+  // The render stops handing out work after this many seconds, or never if
+  // it is 0
+  real time_budget_seconds = 0.0;
+  // No tile stops before it has this many samples per pixel
+  int min_samples_per_pixel = 16;
+  // With an error target, the samples that converged tiles don't take are
+  // spent on the rest, up to this many times the requested number
+  int max_sample_multiplier = 4;
+};
+// Errors are relative to at least this luminance, so that black pixels can
+// converge too
+constexpr real adaptive_error_floor = 0.01;
+
+// Settings for saving the progress of a render, so that it can carry on after
+// being interrupted
+struct checkpoint_settings {
+  // Where the checkpoint is saved, or nowhere if empty
+  std::string filename;
+  // How often the checkpoint is saved, as well as at the end of the render
+  real interval_seconds = 60.0;
+  // Whether to carry on from the checkpoint, if there is one
+  bool resume = false;
+};
+
+// Estimates the light arriving at rec, the closest hit along r, directly from
+// a point chosen on one of the lights. The estimate is weighted against the
+// material finding the same point by scattering.
+colour sample_direct_lighting(const hittable &world, const light_list &lights,
+                              const ray &r, const hit_record &rec,
+                              sampler &samples) {
+  light_list::light_sample light;
+  if (!lights.sample(rec.p, r.time, samples, light))
     return colour(0.0);
-  }
 
-  hit_record rec;
-  if (!world.hit(r, eps, inf, rec))
+  const vec3 &direction = light.direction;
+  const colour f = rec.mat_ptr->eval(r, rec, direction);
+  if (f == colour(0.0) || light.emitted == colour(0.0))
     return colour(0.0);
 
-  const colour emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+  // Light from the environment is blocked by anything in its direction
+  if (light.at_infinity) {
+    if (world.occluded(rec.spawn_ray(direction, r.time), 0.0, inf))
+      return colour(0.0);
+  } else {
+    const ray shadow_ray =
+        rec.spawn_ray_to(light.p, light.p_error, light.normal, r.time);
+    if (world.occluded(shadow_ray, 0.0, real(1.0) - shadow_epsilon))
+      return colour(0.0);
+  }
 
-  ray scattered;
-  colour attenuation;
-  if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-    return emitted;
+  const real scatter_pdf = rec.mat_ptr->pdf(r, rec, direction);
+  return f * light.emitted *
+         (util::power_heuristic(light.pdf, scatter_pdf) / light.pdf);
+}
 
-  return emitted + attenuation * ray_colour(scattered, world, depth - 1,
-                                            attenuation * contribution);
+// Follows the path starting at r for at most max_depth bounces, accumulating
+// emitted light weighted by the path's throughput. Materials which support it
+// also sample the lights directly at each bounce, and light found both ways
+// is combined with multiple importance sampling. Paths which escape the scene
+// pick up its environment, if any. After a few bounces, the path survives
+// with a probability proportional to its throughput, and survivors are
+// reweighted so that the estimate stays unbiased.
+//
+// Texture lookups are filtered over a cone around the path, which starts at
+// the camera and widens by pixel_spread_angle per unit of distance. Bounces
+// don't widen it any further, which keeps textures seen through them as
+// sharp as if seen directly, rather than blurring them by an amount which
+// depends on the surfaces in between. A spread angle of zero point samples
+// every texture.
+__attribute__((hot)) colour ray_colour(const ray &r, const hittable &world,
+                                       const light_list &lights,
+                                       const int max_depth, sampler &samples,
+                                       const real pixel_spread_angle = 0.0) {
+  colour result(0.0), throughput(1.0);
+  ray current_ray = r;
+  real cone_width = 0.0;
+  // Where the previous bounce was, and the density with which it scattered
+  // along current_ray if it also sampled the lights, or 0 otherwise
+  point3 previous_p(0.0);
+  real scatter_pdf = 0.0;
+  for (int depth = 0; depth < max_depth; ++depth) {
+    hit_record rec;
+    if (!world.hit(current_ray, 0.0, inf, rec)) {
+      if (const environment_light *environment = lights.environment()) {
+        const colour emitted = environment->emitted(current_ray.dir);
+        const real weight =
+            scatter_pdf > 0.0
+                ? util::power_heuristic(
+                      scatter_pdf, lights.environment_pdf(current_ray.dir))
+                : 1.0;
+        result += throughput * emitted * weight;
+      }
+      break;
+    }
+    rec.compute_surface_interaction(current_ray);
+    if (pixel_spread_angle > 0.0) {
+      cone_width += pixel_spread_angle * rec.t * glm::length(current_ray.dir);
+      rec.set_footprint(current_ray, cone_width);
+    }
+
+    const colour emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    if (scatter_pdf > 0.0 && emitted != colour(0.0)) {
+      const real light_pdf = lights.pdf(previous_p, current_ray, rec);
+      result += throughput * emitted *
+                util::power_heuristic(scatter_pdf, light_pdf);
+    } else {
+      result += throughput * emitted;
+    }
+
+    const material &mat = *rec.mat_ptr;
+    const bool sample_lights = !lights.empty() && mat.samples_lights();
+    if (sample_lights)
+      result += throughput * sample_direct_lighting(world, lights, current_ray,
+                                                    rec, samples);
+
+    ray scattered;
+    colour attenuation;
+    if (!mat.scatter(current_ray, rec, attenuation, scattered, samples))
+      break;
+    throughput *= attenuation;
+    scatter_pdf =
+        sample_lights ? mat.pdf(current_ray, rec, scattered.dir) : 0.0;
+    previous_p = rec.p;
+
+    if (depth + 1 >= russian_roulette_depth) {
+      const real survival_probability =
+          std::min(std::max({throughput.x, throughput.y, throughput.z}),
+                   real(1.0) - min_termination_probability);
+      if (samples.get_1d() >= survival_probability)
+        break;
+      throughput /= survival_probability;
+    }
+    current_ray = scattered;
+  }
+  return result;
 }
 
 enum TileProtocol {
@@ -50,7 +182,7 @@ enum TileProtocol {
 
 inline colour normal_to_colour(const vec3 &normal) {
   assert(std::abs(glm::length(normal) - 1.0) < eps);
-  return 0.5 * (normal + vec3(1.0));
+  return real(0.5) * (normal + vec3(1.0));
 }
 
 void render_debug(const hittable_list &world, const camera &cam,
@@ -68,8 +200,9 @@ void render_debug(const hittable_list &world, const camera &cam,
       const ray r = cam.get_debug_ray(u, v);
 
       hit_record rec;
-      if (!world.hit(r, eps, inf, rec))
+      if (!world.hit(r, 0.0, inf, rec))
         continue;
+      rec.compute_surface_interaction(r);
       normal_colour = normal_to_colour(rec.normal);
       uv_colour = vec3(1.0, rec.u, rec.v);
 
@@ -81,11 +214,13 @@ void render_debug(const hittable_list &world, const camera &cam,
   }
 }
 
-void render_singlethreaded(const hittable_list &world, const camera &cam,
+template <class sampler_type = sobol_sampler>
+void render_singlethreaded(const hittable_list &world, const light_list &lights,
+                           const camera &cam,
                            const std::string_view &output,
                            const int image_width, const int image_height,
-                           const int samples_per_pixel, const TileProtocol) {
-  const int max_depth = 100;
+                           const int samples_per_pixel, const TileProtocol,
+                           const int max_depth = default_max_depth) {
 
   image result_image(image_width, image_height);
   std::vector<long long> debug_times(image_width * image_height, 0);
@@ -94,23 +229,39 @@ void render_singlethreaded(const hittable_list &world, const camera &cam,
   const auto start_ms = util::get_time_ms();
   size_t pixels = 0;
   std::cout << "Starting render with 1 thread..." << std::endl;
-  const auto pixel_jitters = util::get_sobol_sequence(2, samples_per_pixel);
+
+  // Each thread renders a row into a buffer of its own, then publishes it to
+  // result_image and to finished_pixels. The writer only ever reads
+  // finished_pixels, under the mutex, so it never sees a row being written.
+  std::mutex finished_mutex;
+  std::vector<colour> finished_pixels(image_width * image_height, colour(0.0));
+  image progress_image(image_width, image_height);
+  background_writer progress_writer([&]() {
+    {
+      std::lock_guard<std::mutex> lock(finished_mutex);
+      progress_image.m_pixels = finished_pixels;
+    }
+    progress_image.write_png("build/output/progress.png");
+  });
 
 #pragma omp parallel for
   for (int j = 0; j < image_height; ++j) {
+    std::vector<colour> row_pixels(image_width);
     for (int i = 0; i < image_width; ++i) {
       const auto pixel_start_ns = util::get_time_ns();
       colour pixel_colour(0.0);
+      sampler_type samples;
       for (int s = 0; s < samples_per_pixel; ++s) {
-        const auto &[dx, dy] = pixel_jitters[s];
+        samples.start_pixel_sample(j * image_width + i, s);
+        const auto [dx, dy] = samples.get_2d();
         const real u = (i + dx) / image_width;
         const real v = (j + dy) / image_height;
-        const ray r = cam.get_ray(u, v);
-        pixel_colour += ray_colour(r, world, max_depth);
+        const ray r = cam.get_ray(u, v, samples);
+        pixel_colour += ray_colour(r, world, lights, max_depth, samples,
+                                   cam.m_pixel_spread_angle);
       }
       pixels++;
-      result_image.set(j, i,
-                       pixel_colour / static_cast<real>(samples_per_pixel));
+      row_pixels[i] = pixel_colour / static_cast<real>(samples_per_pixel);
 
       static long long last_update_ms = 0;
       const long long current_time_ms = util::get_time_ms();
@@ -133,21 +284,32 @@ void render_singlethreaded(const hittable_list &world, const camera &cam,
                   << estimated_remaining_ms / 1000 << "s remaining, "
                   << remaining_tasks << "/" << num_tasks
                   << " pixels remaining... " << std::flush;
-        result_image.write_png("build/output/progress.png");
+        progress_writer.request();
       }
     }
 
-    image debug_image(image_width, image_height);
+    std::copy(row_pixels.begin(), row_pixels.end(),
+              result_image.m_pixels.begin() + j * image_width);
+    {
+      std::lock_guard<std::mutex> lock(finished_mutex);
+      std::copy(row_pixels.begin(), row_pixels.end(),
+                finished_pixels.begin() + j * image_width);
+    }
+  }
+  progress_writer.finish();
+
+  // How long each pixel took, relative to the slowest, written once every
+  // pixel is done so that the render threads never wait for it
+  image debug_image(image_width, image_height);
 #pragma omp parallel for
-    for (int row = 0; row < image_height; ++row) {
-      for (int i = 0; i < image_width; ++i) {
-        const real pixel_ns = debug_times[row * image_width + i];
-        const real ratio = pixel_ns / slowest_pixel;
-        debug_image.set(row, i, colour(ratio));
-      }
+  for (int row = 0; row < image_height; ++row) {
+    for (int i = 0; i < image_width; ++i) {
+      const real pixel_ns = debug_times[row * image_width + i];
+      const real ratio = pixel_ns / slowest_pixel;
+      debug_image.set(row, i, colour(ratio));
     }
-    debug_image.write_png("build/output/debug.png");
   }
+  debug_image.write_png("build/output/debug.png");
 
   const auto end_ms = util::get_time_ms();
   const real elapsed_seconds = (end_ms - start_ms) / 1000.0;
@@ -155,111 +317,302 @@ void render_singlethreaded(const hittable_list &world, const camera &cam,
             << "Done! Took " << elapsed_seconds << " seconds" << std::endl;
 
   result_image.write_png("build/output/progress.png");
-  result_image.write_png(output);
+  result_image.write(output);
 }
 
-void render(const hittable_list &world, const camera &cam,
-            const std::string_view &output, const int image_width,
-            const int image_height, const int samples_per_pixel,
-            const TileProtocol protocol = PER_TILE) {
-  const int max_threads = 4;
-  const int max_depth = 100;
-
+template <class sampler_type = sobol_sampler>
+void render(const hittable_list &world, const light_list &lights,
+            const camera &cam, const std::string_view &output,
+            const int image_width, const int image_height,
+            const int samples_per_pixel, const TileProtocol protocol = PER_TILE,
+            const int max_depth = default_max_depth,
+            const int num_threads = default_num_threads(),
+            const adaptive_settings &adaptive = adaptive_settings(),
+            const checkpoint_settings &checkpointing = checkpoint_settings()) {
   const auto [tile_width, tile_height, tile_weight] = std::invoke(
       [&](const TileProtocol protocol) {
         switch (protocol) {
         case PER_FRAME:
-          return std::make_tuple(image_width, image_height / max_threads, 8);
+          return std::make_tuple(image_width,
+                                 std::max(1, image_height / num_threads), 8);
         case PER_PIXEL:
           return std::make_tuple(1, 1, samples_per_pixel);
         case PER_LINE:
-          return std::make_tuple(image_width / max_threads, 1, 32);
+          return std::make_tuple(std::max(1, image_width / num_threads), 1, 32);
         case PER_TILE:
-          return std::make_tuple(16, 16, samples_per_pixel / 256);
+          return std::make_tuple(16, 16, std::max(1, samples_per_pixel / 256));
         }
       },
       protocol);
 
-  struct task {
-    int tile_row, tile_col, tile_height, tile_width, sample_idx, tile_weight;
-  };
-
   image result_image(image_width, image_height);
   std::vector<colour> framebuffer(image_width * image_height);
   std::vector<int> weights(image_width * image_height);
-  std::mutex image_mutex;
+  // The sum of the squared luminance of every sample, for estimating the
+  // variance of each pixel
+  std::vector<real> squared_luminances(image_width * image_height);
   std::atomic<long long> num_samples = 0;
-  const auto pixel_jitters = util::get_sobol_sequence(2, samples_per_pixel);
 
-  auto compute_tile = [&](const task &tsk) {
-    std::vector<colour> tmp_image(image_width * image_height);
+  // Each tile's state is twice the number of passes merged into it, plus one
+  // while some thread owns its pixels, either to merge the next pass or to
+  // resolve them into result_image. Only the owner touches a tile's pixels,
+  // so no locks are needed, and the release when ownership ends publishes its
+  // writes to the next owner.
+  const int tiles_x = (image_width + tile_width - 1) / tile_width;
+  const int num_tiles =
+      ((image_height + tile_height - 1) / tile_height) * tiles_x;
+  std::vector<std::atomic<int>> tile_states(num_tiles);
+
+  // A resumed render starts from the checkpoint's buffers, with each tile's
+  // next sample being the number of samples it already has
+  std::vector<int> start_samples;
+  if (checkpointing.resume && !checkpointing.filename.empty()) {
+    render_checkpoint checkpoint;
+    if (checkpoint.read(checkpointing.filename)) {
+      if (checkpoint.m_width != image_width ||
+          checkpoint.m_height != image_height ||
+          checkpoint.m_tile_width != tile_width ||
+          checkpoint.m_tile_height != tile_height)
+        throw std::runtime_error(
+            "Checkpoint does not match the image and tile size of the render");
+      framebuffer = std::move(checkpoint.m_framebuffer);
+      weights = std::move(checkpoint.m_weights);
+      squared_luminances = std::move(checkpoint.m_squared_luminances);
+      start_samples.resize(num_tiles);
+      for (int tile_idx = 0; tile_idx < num_tiles; ++tile_idx) {
+        const int tile_row = (tile_idx / tiles_x) * tile_height;
+        const int tile_col = (tile_idx % tiles_x) * tile_width;
+        start_samples[tile_idx] = weights[tile_row * image_width + tile_col];
+      }
+      num_samples = std::accumulate(weights.begin(), weights.end(), 0ll);
+      std::cout << "Resuming from checkpoint '" << checkpointing.filename
+                << "' with "
+                << static_cast<real>(num_samples) /
+                       (image_width * image_height)
+                << " samples per pixel on average" << std::endl;
+    }
+  }
+
+  // With an error target, the requested samples per pixel become a budget for
+  // the whole image, which converged tiles leave to the others
+  const bool use_error_target = adaptive.error_target > 0.0;
+  const long long sample_budget =
+      use_error_target ? static_cast<long long>(samples_per_pixel) *
+                             image_width * image_height
+                       : std::numeric_limits<long long>::max();
+  const int max_samples_per_pixel =
+      use_error_target ? samples_per_pixel * adaptive.max_sample_multiplier
+                       : samples_per_pixel;
+  tile_scheduler scheduler(image_width, image_height, tile_width, tile_height,
+                           samples_per_pixel, tile_weight, num_threads,
+                           max_samples_per_pixel, sample_budget,
+                           start_samples);
+
+  // The root mean square of the relative standard errors of the tile's
+  // pixels, or infinity if some pixel has too few samples to tell. Must be
+  // called by the tile's owner.
+  auto tile_error = [&](const tile_task &tsk) {
+    real sum_squared_errors = 0.0;
+    for (int j = tsk.tile_row; j < tsk.tile_row + tsk.tile_height; ++j) {
+      for (int i = tsk.tile_col; i < tsk.tile_col + tsk.tile_width; ++i) {
+        const int idx = j * image_width + i;
+        const real n = weights[idx];
+        if (weights[idx] < std::max(2, adaptive.min_samples_per_pixel))
+          return std::numeric_limits<real>::max();
+        const real mean = luminance(framebuffer[idx]) / n;
+        const real variance = std::max<real>(
+            0.0, (squared_luminances[idx] - n * mean * mean) / (n - 1.0));
+        const real scale = std::max(std::abs(mean), adaptive_error_floor);
+        sum_squared_errors += variance / (n * scale * scale);
+      }
+    }
+    return std::sqrt(sum_squared_errors / (tsk.tile_width * tsk.tile_height));
+  };
+
+  // Each worker renders into its own tile-sized buffers, reused across tasks
+  auto compute_tile = [&](const tile_task &tsk,
+                          std::vector<colour> &tile_buffer,
+                          std::vector<real> &tile_squares) {
+    std::fill(tile_buffer.begin(), tile_buffer.end(), colour(0.0));
+    std::fill(tile_squares.begin(), tile_squares.end(), 0.0);
+    sampler_type samples;
     for (int j = tsk.tile_row; j < tsk.tile_row + tsk.tile_height; ++j) {
       for (int i = tsk.tile_col; i < tsk.tile_col + tsk.tile_width; ++i) {
-        colour &pixel_colour = tmp_image[j * image_width + i];
+        const int tile_idx =
+            (j - tsk.tile_row) * tsk.tile_width + i - tsk.tile_col;
         for (int s = 0; s < tsk.tile_weight; ++s) {
-          const auto &[dx, dy] = pixel_jitters[tsk.sample_idx + s];
+          samples.start_pixel_sample(j * image_width + i, tsk.sample_idx + s);
+          const auto [dx, dy] = samples.get_2d();
           const real u = (i + dx) / image_width;
           const real v = (j + dy) / image_height;
-          const ray r = cam.get_ray(u, v);
-          pixel_colour += ray_colour(r, world, max_depth);
+          const ray r = cam.get_ray(u, v, samples);
+          const colour sample = ray_colour(r, world, lights, max_depth,
+                                           samples, cam.m_pixel_spread_angle);
+          const real sample_luminance = luminance(sample);
+          tile_buffer[tile_idx] += sample;
+          tile_squares[tile_idx] += sample_luminance * sample_luminance;
         }
-        num_samples += tsk.tile_weight;
       }
     }
-
-    std::lock_guard<std::mutex> guard(image_mutex);
+    num_samples += tsk.tile_width * tsk.tile_height * tsk.tile_weight;
+
+    // Floating point addition is not associative, so passes are merged into
+    // each tile in order to make the image independent of the thread count.
+    // The scheduler hands out the previous pass first, so it is already in
+    // progress.
+    std::atomic<int> &state = tile_states[tsk.tile_idx];
+    int idle_state = 2 * tsk.pass_idx;
+    while (!state.compare_exchange_weak(idle_state, idle_state + 1,
+                                        std::memory_order_acquire)) {
+      idle_state = 2 * tsk.pass_idx;
+      std::this_thread::yield();
+    }
     for (int j = tsk.tile_row; j < tsk.tile_row + tsk.tile_height; ++j) {
       for (int i = tsk.tile_col; i < tsk.tile_col + tsk.tile_width; ++i) {
         const int idx = j * image_width + i;
-        framebuffer[idx] += tmp_image[idx];
+        const int tile_idx =
+            (j - tsk.tile_row) * tsk.tile_width + i - tsk.tile_col;
+        framebuffer[idx] += tile_buffer[tile_idx];
+        squared_luminances[idx] += tile_squares[tile_idx];
         weights[idx] += tsk.tile_weight;
-        result_image.set(j, i,
-                         framebuffer[idx] / static_cast<real>(weights[idx]));
       }
     }
+    if (use_error_target && tile_error(tsk) < adaptive.error_target)
+      scheduler.retire(tsk.tile_idx);
+    state.store(idle_state + 2, std::memory_order_release);
   };
 
-  std::vector<task> task_list;
-  std::atomic<size_t> next_task_idx = 0;
-
-  for (int samples = 0; samples < samples_per_pixel; samples += tile_weight) {
-    for (int tile_row = 0; tile_row < image_height; tile_row += tile_height) {
-      for (int tile_col = 0; tile_col < image_width; tile_col += tile_width) {
-        const int task_height = std::min(image_height - tile_row, tile_height);
-        const int task_width = std::min(image_width - tile_col, tile_width);
-        const int task_samples =
-            std::min(samples_per_pixel - samples, tile_weight);
-        task_list.push_back({tile_row, tile_col, task_height, task_width,
-                             samples, task_samples});
+  // Brings result_image up to date with every tile which has changed since
+  // the last call. Tiles which are busy keep their previous values rather than
+  // making a worker wait. Must not be called from two threads at once.
+  // Resumed tiles start out unresolved
+  std::vector<int> resolved_states(num_tiles, 0);
+  for (int tile_idx = 0; tile_idx < num_tiles; ++tile_idx)
+    if (!start_samples.empty() && start_samples[tile_idx] > 0)
+      resolved_states[tile_idx] = -1;
+  auto resolve = [&]() {
+    for (int tile_idx = 0; tile_idx < num_tiles; ++tile_idx) {
+      std::atomic<int> &state = tile_states[tile_idx];
+      int idle_state = state.load(std::memory_order_relaxed);
+      if (idle_state == resolved_states[tile_idx] || idle_state % 2 != 0 ||
+          !state.compare_exchange_strong(idle_state, idle_state + 1,
+                                         std::memory_order_acquire))
+        continue;
+      const int tile_row = (tile_idx / tiles_x) * tile_height;
+      const int tile_col = (tile_idx % tiles_x) * tile_width;
+      const int row_end = std::min(image_height, tile_row + tile_height);
+      const int col_end = std::min(image_width, tile_col + tile_width);
+      for (int j = tile_row; j < row_end; ++j) {
+        for (int i = tile_col; i < col_end; ++i) {
+          const int idx = j * image_width + i;
+          result_image.set(j, i,
+                           framebuffer[idx] / static_cast<real>(weights[idx]));
+        }
       }
+      resolved_states[tile_idx] = idle_state;
+      state.store(idle_state, std::memory_order_release);
+    }
+  };
+
+  // Saves every tile's merged passes, waiting for any busy tiles since the
+  // checkpoint needs them all. Must not be called from two threads at once.
+  auto save_checkpoint = [&]() {
+    render_checkpoint checkpoint(image_width, image_height, tile_width,
+                                 tile_height);
+    for (int tile_idx = 0; tile_idx < num_tiles; ++tile_idx) {
+      std::atomic<int> &state = tile_states[tile_idx];
+      int idle_state = state.load(std::memory_order_relaxed);
+      while (idle_state % 2 != 0 ||
+             !state.compare_exchange_weak(idle_state, idle_state + 1,
+                                          std::memory_order_acquire)) {
+        std::this_thread::yield();
+        idle_state = state.load(std::memory_order_relaxed);
+      }
+      const int tile_row = (tile_idx / tiles_x) * tile_height;
+      const int tile_col = (tile_idx % tiles_x) * tile_width;
+      const int row_end = std::min(image_height, tile_row + tile_height);
+      const int col_end = std::min(image_width, tile_col + tile_width);
+      for (int j = tile_row; j < row_end; ++j) {
+        for (int i = tile_col; i < col_end; ++i) {
+          const int idx = j * image_width + i;
+          checkpoint.m_framebuffer[idx] = framebuffer[idx];
+          checkpoint.m_weights[idx] = weights[idx];
+          checkpoint.m_squared_luminances[idx] = squared_luminances[idx];
+        }
+      }
+      state.store(idle_state, std::memory_order_release);
+    }
+    checkpoint.write(checkpointing.filename);
+  };
+
+  // Tiles which converged before the render was interrupted stay retired
+  if (use_error_target) {
+    for (int tile_idx = 0; tile_idx < num_tiles; ++tile_idx) {
+      if (start_samples.empty() || start_samples[tile_idx] == 0)
+        continue;
+      const int tile_row = (tile_idx / tiles_x) * tile_height;
+      const int tile_col = (tile_idx % tiles_x) * tile_width;
+      const tile_task tsk = {tile_row,
+                             tile_col,
+                             std::min(image_height - tile_row, tile_height),
+                             std::min(image_width - tile_col, tile_width),
+                             start_samples[tile_idx],
+                             0,
+                             tile_idx,
+                             0};
+      if (tile_error(tsk) < adaptive.error_target)
+        scheduler.retire(tile_idx);
     }
   }
 
-  std::cerr << "Starting render with " << task_list.size() << " tasks and "
-            << max_threads << " threads..." << std::endl;
+  std::cerr << "Starting render with " << scheduler.num_tasks()
+            << " tasks and " << num_threads << " threads..." << std::endl;
   std::cerr << "There are " << material_manager::size() << " materials loaded"
             << std::endl;
   const auto start_ms = util::get_time_ms();
-  const int num_tasks = task_list.size();
+
+  // Progress is reported by whichever worker first notices that it is due,
+  // while the others carry on
+  std::atomic<bool> reporting = false;
+  std::atomic<long long> last_update_ms = start_ms;
+  int last_tasks = 0;
+  long long last_samples = num_samples;
+
+  // The progress image and checkpoint are written off the render threads,
+  // which only ask for them
+  long long last_checkpoint_ms = start_ms;
+  background_writer progress_writer([&]() {
+    resolve();
+    result_image.write_png("build/output/progress.png");
+    const long long current_time_ms = util::get_time_ms();
+    if (!checkpointing.filename.empty() &&
+        current_time_ms - last_checkpoint_ms >
+            checkpointing.interval_seconds * 1000) {
+      save_checkpoint();
+      last_checkpoint_ms = current_time_ms;
+    }
+  });
 
   std::vector<std::thread> threads;
-  for (int i = 0; i < max_threads; ++i) {
-    threads.emplace_back([&]() {
-      while (true) {
-        const int task_idx = next_task_idx++;
-        if (task_idx >= num_tasks)
-          break;
-        compute_tile(task_list[task_idx]);
-
-        static long long last_update_ms = util::get_time_ms();
-        static int last_tasks = 0;
-        static size_t last_samples = 0;
+  for (int worker_idx = 0; worker_idx < num_threads; ++worker_idx) {
+    threads.emplace_back([&, worker_idx]() {
+      std::vector<colour> tile_buffer(tile_width * tile_height);
+      std::vector<real> tile_squares(tile_width * tile_height);
+      tile_task task;
+      while (scheduler.next(worker_idx, task)) {
+        compute_tile(task, tile_buffer, tile_squares);
+
         const long long current_time_ms = util::get_time_ms();
-        if (current_time_ms - last_update_ms > 1000) {
+        if (adaptive.time_budget_seconds > 0.0 &&
+            current_time_ms - start_ms > adaptive.time_budget_seconds * 1000)
+          scheduler.stop();
+        if (current_time_ms - last_update_ms > 1000 &&
+            !reporting.exchange(true, std::memory_order_acquire)) {
           const real update_ms = current_time_ms - last_update_ms;
           last_update_ms = current_time_ms;
           const real elapsed_ms = current_time_ms - start_ms;
-          const int done_tasks = next_task_idx;
+          const int num_tasks = scheduler.num_tasks();
+          const int done_tasks = scheduler.num_handed_out();
           const int remaining_tasks = std::max(0, num_tasks - done_tasks);
           const int this_updates_tasks = done_tasks - last_tasks;
           const int this_updates_samples = num_samples - last_samples;
@@ -280,7 +633,8 @@ void render(const hittable_list &world, const camera &cam,
           if (output_length < target_line_length)
             output_line << std::string(target_line_length - output_length, ' ');
           std::cout << output_line.str() << std::flush;
-          result_image.write_png("build/output/progress.png");
+          progress_writer.request();
+          reporting.store(false, std::memory_order_release);
         }
       }
     });
@@ -289,29 +643,229 @@ void render(const hittable_list &world, const camera &cam,
   for (auto &thread : threads) {
     thread.join();
   }
+  progress_writer.finish();
+  resolve();
+  if (!checkpointing.filename.empty())
+    save_checkpoint();
 
   const auto end_ms = util::get_time_ms();
   const real elapsed_seconds = (end_ms - start_ms) / 1000.0;
   std::cout << std::endl
             << "Done! Took " << elapsed_seconds << " seconds" << std::endl;
+  std::cout << "  "
+            << static_cast<real>(num_samples) / (image_width * image_height)
+            << " samples per pixel on average" << std::endl;
 
   result_image.write_png("build/output/progress.png");
-  result_image.write_png(output);
+  result_image.write(output);
+}
+
+// Renders straight to a .pfm or .exr file, band_height rows at a time, so that
+// memory use is bounded by the size of a band rather than of the image. The
+// rows of each band are shared out between the threads, and the band is
+// written out as soon as they are all done.
+template <class sampler_type = sobol_sampler>
+void render_streamed(const hittable_list &world, const light_list &lights,
+                     const camera &cam, const std::string_view &output,
+                     const int image_width, const int image_height,
+                     const int samples_per_pixel, const int band_height = 64,
+                     const int max_depth = default_max_depth,
+                     const int num_threads = default_num_threads()) {
+  float_image_writer writer(output, image_width, image_height);
+  std::vector<colour> band(image_width * band_height);
+
+  std::cerr << "Starting streamed render with " << num_threads
+            << " threads..." << std::endl;
+  const auto start_ms = util::get_time_ms();
+
+  for (int band_row = 0; band_row < image_height; band_row += band_height) {
+    const int band_end = std::min(image_height, band_row + band_height);
+    std::atomic<int> next_row = band_row;
+    std::vector<std::thread> threads;
+    for (int thread_idx = 0; thread_idx < num_threads; ++thread_idx) {
+      threads.emplace_back([&]() {
+        sampler_type samples;
+        for (int j = next_row++; j < band_end; j = next_row++) {
+          for (int i = 0; i < image_width; ++i) {
+            colour pixel_colour(0.0);
+            for (int s = 0; s < samples_per_pixel; ++s) {
+              samples.start_pixel_sample(j * image_width + i, s);
+              const auto [dx, dy] = samples.get_2d();
+              const real u = (i + dx) / image_width;
+              const real v = (j + dy) / image_height;
+              const ray r = cam.get_ray(u, v, samples);
+              pixel_colour += ray_colour(r, world, lights, max_depth,
+                                         samples, cam.m_pixel_spread_angle);
+            }
+            band[(j - band_row) * image_width + i] =
+                pixel_colour / static_cast<real>(samples_per_pixel);
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    writer.write_rows(band_row, band_end - band_row, band.data());
+
+    const real elapsed_ms = util::get_time_ms() - start_ms;
+    std::cout << "\r" << elapsed_ms / 1000 << "s elapsed, " << band_end << "/"
+              << image_height << " rows written... " << std::flush;
+  }
+
+  const real elapsed_seconds = (util::get_time_ms() - start_ms) / 1000.0;
+  std::cout << std::endl
+            << "Done! Took " << elapsed_seconds << " seconds" << std::endl;
+}
+
+// Reports how far test is from reference, e.g. to check a float render
+// against the same scene rendered in double precision
+int compare_images(const std::string_view &reference_filename,
+                   const std::string_view &test_filename) {
+  const image reference(reference_filename), test(test_filename);
+  if (reference.m_pixels.empty() || test.m_pixels.empty())
+    return 1;
+  if (reference.m_width != test.m_width ||
+      reference.m_height != test.m_height) {
+    std::cerr << "ERROR: Cannot compare a " << reference.m_width << "x"
+              << reference.m_height << " image to a " << test.m_width << "x"
+              << test.m_height << " image" << std::endl;
+    return 1;
+  }
+
+  const size_t num_pixels = reference.m_pixels.size();
+  double sum_abs_error = 0.0, sum_squared_error = 0.0, max_abs_error = 0.0;
+  for (size_t idx = 0; idx < num_pixels; ++idx) {
+    const colour difference = test.m_pixels[idx] - reference.m_pixels[idx];
+    for (int channel = 0; channel < 3; ++channel) {
+      const double error = std::abs(difference[channel]);
+      sum_abs_error += error;
+      sum_squared_error += error * error;
+      max_abs_error = std::max(max_abs_error, error);
+    }
+  }
+  const double num_values = 3.0 * num_pixels;
+  const double rmse = std::sqrt(sum_squared_error / num_values);
+
+  std::cout << "Compared '" << test_filename << "' to '" << reference_filename
+            << "'" << std::endl;
+  std::cout << "  Mean absolute error: " << sum_abs_error / num_values
+            << std::endl;
+  std::cout << "  RMSE               : " << rmse << std::endl;
+  std::cout << "  PSNR               : " << -20.0 * std::log10(rmse) << " dB"
+            << std::endl;
+  std::cout << "  Max absolute error : " << max_abs_error << std::endl;
+  return 0;
+}
+
+// Times encode_bytes against encode_bytes_reference on an 8K frame of values
+// spread over [0, 1.5), and checks that they agree
+int benchmark_encoding() {
+  const int width = 7680, height = 4320;
+  std::vector<real> values(3 * width * height);
+  for (real &value : values)
+    value = util::random_real(0.0, 1.5);
+  std::vector<unsigned char> reference(values.size()), encoded(values.size());
+
+  // The best of a few runs, to keep noise out
+  const auto time_ms = [](const auto &encode) {
+    long long best_ms = std::numeric_limits<long long>::max();
+    for (int run = 0; run < 5; ++run) {
+      const long long start_ms = util::get_time_ms();
+      encode();
+      best_ms = std::min(best_ms, util::get_time_ms() - start_ms);
+    }
+    return best_ms;
+  };
+  const long long reference_ms = time_ms([&]() {
+    encode_bytes_reference(values.data(), values.size(), reference.data());
+  });
+  const long long encoded_ms = time_ms(
+      [&]() { encode_bytes(values.data(), values.size(), encoded.data()); });
+  const size_t mismatches =
+      values.size() - std::inner_product(reference.begin(), reference.end(),
+                                         encoded.begin(), size_t(0),
+                                         std::plus<>(), std::equal_to<>());
+
+  std::cout << "Encoded a " << width << "x" << height << " frame" << std::endl;
+  std::cout << "  Reference: " << reference_ms << " ms" << std::endl;
+  std::cout << "  Lookup   : " << encoded_ms << " ms ("
+            << static_cast<real>(reference_ms) / std::max(1ll, encoded_ms)
+            << "x faster)" << std::endl;
+  std::cout << "  " << mismatches << " bytes differ" << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+// The instancing named by --instancing
+instancing parse_instancing(const std::string_view &name) {
+  if (name == "tlas")
+    return instancing::tlas;
+  if (name == "mbvh4")
+    return instancing::mbvh4;
+  if (name == "mbvh8")
+    return instancing::mbvh8;
+  throw std::runtime_error("Unknown instancing '" + std::string(name) +
+                           "', expected tlas, mbvh4 or mbvh8");
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+  if (argc == 4 && std::string_view(argv[1]) == "--compare")
+    return compare_images(argv[2], argv[3]);
+  if (argc == 2 && std::string_view(argv[1]) == "--benchmark-encoding")
+    return benchmark_encoding();
+
+  int num_threads = default_num_threads();
+  adaptive_settings adaptive;
+  checkpoint_settings checkpointing;
+  instancing instance_structure = instancing::tlas;
+  std::string output = USE_FLOATS ? "build/instance_scene_float.png"
+                                  : "build/instance_scene.png";
+  bool stream = false;
+  for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+    const std::string_view arg = argv[arg_idx];
+    const bool has_value = arg_idx + 1 < argc;
+    if (arg == "--threads" && has_value)
+      num_threads = std::max(1, std::atoi(argv[++arg_idx]));
+    else if (arg == "--error-target" && has_value)
+      adaptive.error_target = std::atof(argv[++arg_idx]);
+    else if (arg == "--time-budget" && has_value)
+      adaptive.time_budget_seconds = std::atof(argv[++arg_idx]);
+    else if (arg == "--checkpoint" && has_value)
+      checkpointing.filename = argv[++arg_idx];
+    else if (arg == "--checkpoint-interval" && has_value)
+      checkpointing.interval_seconds = std::atof(argv[++arg_idx]);
+    else if (arg == "--resume")
+      checkpointing.resume = true;
+    else if (arg == "--instancing" && has_value)
+      instance_structure = parse_instancing(argv[++arg_idx]);
+    else if (arg == "--output" && has_value)
+      output = argv[++arg_idx];
+    else if (arg == "--stream")
+      stream = true;
+  }
+  if (stream && !float_image_writer::supports(output))
+    throw std::runtime_error("--stream needs a .pfm or .exr --output, not '" +
+                             output + "'");
+
   if (false) {
     const auto scene = bright_scene();
-    render_singlethreaded(scene.objects, scene.cam, "build/bright_scene.png",
-                          scene.cam.m_image_width, scene.cam.m_image_height, 50,
-                          PER_FRAME);
+    render_singlethreaded(scene.objects, scene.lights, scene.cam,
+                          "build/bright_scene.png", scene.cam.m_image_width,
+                          scene.cam.m_image_height, 50, PER_FRAME);
   }
 
   if (true) {
-    const auto scene = instance_scene();
+    const auto scene = instance_scene(instance_structure);
     render_debug(scene.objects, scene.cam, scene.cam.m_image_width,
                  scene.cam.m_image_height);
-    render(scene.objects, scene.cam, "build/instance_scene.png",
-           scene.cam.m_image_width, scene.cam.m_image_height, 10000, PER_FRAME);
+    if (stream)
+      render_streamed(scene.objects, scene.lights, scene.cam, output,
+                      scene.cam.m_image_width, scene.cam.m_image_height, 10000,
+                      64, default_max_depth, num_threads);
+    else
+      render(scene.objects, scene.lights, scene.cam, output,
+             scene.cam.m_image_width, scene.cam.m_image_height, 10000,
+             PER_FRAME, default_max_depth, num_threads, adaptive,
+             checkpointing);
   }
 }
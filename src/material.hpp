@@ -2,6 +2,7 @@
 #pragma once
 
 #include "hittable.hpp"
+#include "sampler.hpp"
 #include "util.hpp"
 
 #include "ray.hpp"
@@ -11,13 +12,40 @@ struct hit_record;
 
 struct material {
   virtual ~material() = default;
+  // samples supplies the random numbers for this bounce
   virtual bool scatter(const ray &r_in, const hit_record &rec,
-                       colour &attenuation, ray &scattered) const = 0;
+                       colour &attenuation, ray &scattered,
+                       sampler &samples) const = 0;
   virtual colour emitted(const real u, const real v, const point3 &p) const {
     return colour(0.0f, 0.0f, 0.0f);
   }
+  // Emissive materials put their surfaces in the scene's light list
+  virtual bool is_emissive() const { return false; }
+
+  // Materials which return true here are also lit by sampling the lights
+  // directly, and implement eval and pdf
+  virtual bool samples_lights() const { return false; }
+  // The fraction of the light arriving from direction which scatters back
+  // along r_in, including the cosine at the surface
+  virtual colour eval(const ray &r_in, const hit_record &rec,
+                      const vec3 &direction) const {
+    return colour(0.0);
+  }
+  // The solid angle density with which scatter picks direction
+  virtual real pdf(const ray &r_in, const hit_record &rec,
+                   const vec3 &direction) const {
+    return 0.0;
+  }
 };
 
+// The cosine-weighted hemisphere around the shading normal, as sampled by
+// the diffuse materials below
+inline real cosine_hemisphere_pdf(const hit_record &rec,
+                                  const vec3 &direction) {
+  const real cos_theta = glm::dot(rec.normal, glm::normalize(direction));
+  return std::max<real>(cos_theta, 0.0) / pi;
+}
+
 struct lambertian : public material {
   const std::shared_ptr<texture> albedo;
 
@@ -28,15 +56,31 @@ struct lambertian : public material {
   virtual ~lambertian() = default;
 
   virtual bool scatter(const ray &r_in, const hit_record &rec,
-                       colour &attenuation, ray &scattered) const override {
-    const vec3 scatter_direction = rec.normal + util::random_unit_vector();
+                       colour &attenuation, ray &scattered,
+                       sampler &samples) const override {
+    // Offsetting the normal by a uniform unit vector gives a cosine-weighted
+    // direction
+    const auto [u1, u2] = samples.get_2d();
+    const vec3 scatter_direction =
+        rec.normal + util::sample_unit_vector(u1, u2);
     if (util::near_zero(scatter_direction))
       return false; // scatter_direction = rec.normal;
 
-    scattered = ray(rec.p, scatter_direction, r_in.time);
-    attenuation = albedo->value(rec.u, rec.v, rec.p);
+    scattered = rec.spawn_ray(scatter_direction, r_in.time);
+    attenuation = albedo->value(rec.u, rec.v, rec.p, rec.uv_footprint);
     return true;
   }
+
+  virtual bool samples_lights() const override { return true; }
+  virtual colour eval(const ray &r_in, const hit_record &rec,
+                      const vec3 &direction) const override {
+    return albedo->value(rec.u, rec.v, rec.p, rec.uv_footprint) *
+           cosine_hemisphere_pdf(rec, direction);
+  }
+  virtual real pdf(const ray &r_in, const hit_record &rec,
+                   const vec3 &direction) const override {
+    return cosine_hemisphere_pdf(rec, direction);
+  }
 };
 
 struct metal : public material {
@@ -48,10 +92,13 @@ struct metal : public material {
   virtual ~metal() = default;
 
   virtual bool scatter(const ray &r_in, const hit_record &rec,
-                       colour &attenuation, ray &scattered) const override {
+                       colour &attenuation, ray &scattered,
+                       sampler &samples) const override {
     const vec3 reflected = reflect(glm::normalize(r_in.dir), rec.normal);
-    scattered =
-        ray(rec.p, reflected + fuzz * util::random_in_unit_sphere(), r_in.time);
+    const auto [u1, u2] = samples.get_2d();
+    const real u3 = samples.get_1d();
+    scattered = rec.spawn_ray(
+        reflected + fuzz * util::sample_unit_ball(u1, u2, u3), r_in.time);
     attenuation = albedo;
     return glm::dot(scattered.dir, rec.normal) > 0.0;
   }
@@ -72,7 +119,8 @@ struct dielectric : public material {
   }
 
   virtual bool scatter(const ray &r_in, const hit_record &rec,
-                       colour &attenuation, ray &scattered) const override {
+                       colour &attenuation, ray &scattered,
+                       sampler &samples) const override {
     attenuation = albedo;
     const real index_ratio =
         rec.front_face ? 1.0 / index_of_refraction : index_of_refraction;
@@ -84,13 +132,13 @@ struct dielectric : public material {
 
     const bool cannot_reflect = index_ratio * sin_theta > 1.0;
     if (cannot_reflect ||
-        util::random_real() < reflectance(cos_theta, index_ratio)) {
+        samples.get_1d() < reflectance(cos_theta, index_ratio)) {
       const vec3 direction = reflect(unit_direction, rec.normal);
-      scattered = ray(rec.p, direction, r_in.time);
+      scattered = rec.spawn_ray(direction, r_in.time);
       return true;
     } else {
       const vec3 direction = refract(unit_direction, rec.normal, index_ratio);
-      scattered = ray(rec.p, direction, r_in.time);
+      scattered = rec.spawn_ray(direction, r_in.time);
       return true;
     }
   }
@@ -104,7 +152,8 @@ struct diffuse_light : public material {
       : emit(std::make_shared<solid_colour>(a)) {}
 
   virtual bool scatter(const ray &r_in, const hit_record &rec,
-                       colour &attenuation, ray &scattered) const override {
+                       colour &attenuation, ray &scattered,
+                       sampler &samples) const override {
     return false;
   }
 
@@ -112,6 +161,7 @@ struct diffuse_light : public material {
                          const point3 &p) const override {
     return emit->value(u, v, p);
   }
+  virtual bool is_emissive() const override { return true; }
 };
 
 // Stores data from a Wavefront .mtl material file
@@ -133,20 +183,37 @@ struct obj_material : public material {
   explicit obj_material() = default;
 
   virtual bool scatter(const ray &r_in, const hit_record &rec,
-                       colour &attenuation, ray &scattered) const override {
+                       colour &attenuation, ray &scattered,
+                       sampler &samples) const override {
 
-    const vec3 scatter_direction = rec.normal + util::random_unit_vector();
+    const auto [u1, u2] = samples.get_2d();
+    const vec3 scatter_direction =
+        rec.normal + util::sample_unit_vector(u1, u2);
     if (util::near_zero(scatter_direction))
       return false;
 
-    scattered = ray(rec.p, scatter_direction, r_in.time);
-    if (diffuse_map != nullptr)
-      attenuation = diffuse_colour * diffuse_map->value(rec.u, rec.v, rec.p);
-    else
-      attenuation = diffuse_colour;
+    scattered = rec.spawn_ray(scatter_direction, r_in.time);
+    attenuation = diffuse_value(rec);
     return true;
   }
 
+  inline colour diffuse_value(const hit_record &rec) const {
+    if (diffuse_map != nullptr)
+      return diffuse_colour *
+             diffuse_map->value(rec.u, rec.v, rec.p, rec.uv_footprint);
+    return diffuse_colour;
+  }
+
+  virtual bool samples_lights() const override { return true; }
+  virtual colour eval(const ray &r_in, const hit_record &rec,
+                      const vec3 &direction) const override {
+    return diffuse_value(rec) * cosine_hemisphere_pdf(rec, direction);
+  }
+  virtual real pdf(const ray &r_in, const hit_record &rec,
+                   const vec3 &direction) const override {
+    return cosine_hemisphere_pdf(rec, direction);
+  }
+
   virtual colour emitted(const real u, const real v,
                          const point3 &p) const override {
     if (emissive_map != nullptr) {
@@ -155,4 +222,7 @@ struct obj_material : public material {
       return emissive_colour;
     }
   }
+  virtual bool is_emissive() const override {
+    return emissive_map != nullptr || emissive_colour != colour(0.0);
+  }
 };
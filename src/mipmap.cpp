@@ -0,0 +1,212 @@
+#include "mipmap.hpp"
+#include "stb.hpp"
+
+#include <array>
+#include <cmath>
+#include <iostream>
+
+namespace {
+// stbi_loadf's conversion of LDR bytes to linear floats, so that textures
+// look the same as when they were loaded as floats
+constexpr float ldr_gamma = 2.2f;
+
+const std::array<float, 256> &byte_to_linear() {
+  static const std::array<float, 256> table = []() {
+    std::array<float, 256> result;
+    for (int byte = 0; byte < 256; ++byte)
+      result[byte] = static_cast<float>(std::pow(byte / 255.0f, ldr_gamma));
+    return result;
+  }();
+  return table;
+}
+
+inline uint8_t linear_to_byte(const real x) {
+  const real encoded =
+      std::pow(std::clamp<real>(x, 0.0, 1.0), real(1.0 / ldr_gamma));
+  return static_cast<uint8_t>(std::lround(encoded * 255.0));
+}
+
+// Wraps a texel index which is at most one texel outside [0, size), with a
+// mask when size is a power of two
+inline int wrap(const int idx, const int size, const int mask) {
+  if (mask >= 0)
+    return idx & mask;
+  return idx < 0 ? size - 1 : (idx >= size ? 0 : idx);
+}
+
+// The largest finite half float. Anything brighter would become infinity.
+constexpr float max_half = 65504.0f;
+
+inline int power_of_two_mask(const int size) {
+  return (size & (size - 1)) == 0 ? size - 1 : -1;
+}
+} // namespace
+
+mipmap::mipmap(const std::string_view &filename, const bool with_pyramid) {
+  const std::string name(filename);
+  int width = 0, height = 0, components_per_pixel = 3;
+  std::vector<colour> texels;
+  if (stbi_is_hdr(name.c_str())) {
+    m_format = with_pyramid ? texel_format::half : texel_format::float32;
+    float *data = stbi_loadf(name.c_str(), &width, &height,
+                             &components_per_pixel, 3);
+    if (data != nullptr) {
+      texels.resize(static_cast<size_t>(width) * height);
+      for (size_t idx = 0; idx < texels.size(); ++idx)
+        texels[idx] = colour(data[3 * idx + 0], data[3 * idx + 1],
+                             data[3 * idx + 2]);
+      stbi_image_free(data);
+    }
+  } else {
+    m_format = texel_format::rgb8;
+    unsigned char *data = stbi_load(name.c_str(), &width, &height,
+                                    &components_per_pixel, 3);
+    if (data != nullptr) {
+      const std::array<float, 256> &to_linear = byte_to_linear();
+      texels.resize(static_cast<size_t>(width) * height);
+      for (size_t idx = 0; idx < texels.size(); ++idx)
+        texels[idx] =
+            colour(to_linear[data[3 * idx + 0]], to_linear[data[3 * idx + 1]],
+                   to_linear[data[3 * idx + 2]]);
+      stbi_image_free(data);
+    }
+  }
+  if (texels.empty()) {
+    std::cerr << "ERROR: Could not load texture image file '" << filename << "'"
+              << std::endl;
+    std::cerr << stbi_failure_reason() << std::endl;
+    return;
+  }
+
+  append_level(texels, width, height);
+  // Halve the image until it is a single texel
+  while (with_pyramid && (width > 1 || height > 1)) {
+    const int next_width = std::max(1, (width + 1) / 2),
+              next_height = std::max(1, (height + 1) / 2);
+    std::vector<colour> next(static_cast<size_t>(next_width) * next_height);
+    for (int row = 0; row < next_height; ++row) {
+      const int row0 = 2 * row, row1 = std::min(2 * row + 1, height - 1);
+      for (int col = 0; col < next_width; ++col) {
+        const int col0 = 2 * col, col1 = std::min(2 * col + 1, width - 1);
+        next[row * next_width + col] =
+            real(0.25) *
+            (texels[row0 * width + col0] + texels[row0 * width + col1] +
+             texels[row1 * width + col0] + texels[row1 * width + col1]);
+      }
+    }
+    texels = std::move(next);
+    width = next_width;
+    height = next_height;
+    append_level(texels, width, height);
+  }
+
+  std::cout << "Loaded texture '" << filename << "' with size "
+            << m_levels[0].width << " by " << m_levels[0].height << " and "
+            << m_levels.size() << " mip levels, taking "
+            << memory_bytes() / 1024 << " KiB as "
+            << (m_format == texel_format::rgb8
+                    ? "RGB8"
+                    : (m_format == texel_format::half ? "half floats"
+                                                      : "floats"))
+            << std::endl;
+}
+
+void mipmap::append_level(const std::vector<colour> &texels, const int width,
+                          const int height) {
+  const int tiles_per_row = (width + tile_size - 1) / tile_size,
+            tiles_per_column = (height + tile_size - 1) / tile_size;
+  const size_t num_components = static_cast<size_t>(3) * tiles_per_row *
+                                tiles_per_column * tile_size * tile_size;
+  const level lvl = {width,
+                     height,
+                     tiles_per_row,
+                     power_of_two_mask(width),
+                     power_of_two_mask(height),
+                     m_format == texel_format::rgb8
+                         ? m_bytes.size()
+                         : (m_format == texel_format::half ? m_halves.size()
+                                                           : m_floats.size())};
+  m_levels.push_back(lvl);
+
+  if (m_format == texel_format::rgb8)
+    m_bytes.resize(lvl.offset + num_components, 0);
+  else if (m_format == texel_format::half)
+    m_halves.resize(lvl.offset + num_components, 0);
+  else
+    m_floats.resize(lvl.offset + num_components, 0.0f);
+  for (int row = 0; row < height; ++row) {
+    for (int col = 0; col < width; ++col) {
+      const colour &c = texels[static_cast<size_t>(row) * width + col];
+      const size_t idx = texel_index(lvl, row, col);
+      for (int component = 0; component < 3; ++component) {
+        const float value = static_cast<float>(c[component]);
+        if (m_format == texel_format::rgb8)
+          m_bytes[idx + component] = linear_to_byte(c[component]);
+        else if (m_format == texel_format::half)
+          m_halves[idx + component] =
+              to_half(std::clamp(value, -max_half, max_half));
+        else
+          m_floats[idx + component] = value;
+      }
+    }
+  }
+}
+
+size_t mipmap::memory_bytes() const {
+  return m_bytes.size() * sizeof(uint8_t) +
+         m_halves.size() * sizeof(uint16_t) + m_floats.size() * sizeof(float);
+}
+
+colour mipmap::texel(const level &lvl, const int row, const int col) const {
+  const size_t idx = texel_index(lvl, row, col);
+  if (m_format == texel_format::rgb8) {
+    const std::array<float, 256> &to_linear = byte_to_linear();
+    return colour(to_linear[m_bytes[idx]], to_linear[m_bytes[idx + 1]],
+                  to_linear[m_bytes[idx + 2]]);
+  }
+  if (m_format == texel_format::half)
+    return colour(from_half(m_halves[idx]), from_half(m_halves[idx + 1]),
+                  from_half(m_halves[idx + 2]));
+  return colour(m_floats[idx], m_floats[idx + 1], m_floats[idx + 2]);
+}
+
+colour mipmap::bilinear(const level &lvl, const real u, const real v) const {
+  // Texel centres are at half integer coordinates, and v goes up the image
+  const real x = u * lvl.width - real(0.5);
+  const real y = (real(1.0) - v) * lvl.height - real(0.5);
+  const real floor_x = std::floor(x), floor_y = std::floor(y);
+  const real frac_x = x - floor_x, frac_y = y - floor_y;
+  const int col = static_cast<int>(floor_x), row = static_cast<int>(floor_y);
+  const int col0 = wrap(col, lvl.width, lvl.col_mask),
+            col1 = wrap(col + 1, lvl.width, lvl.col_mask);
+  const int row0 = wrap(row, lvl.height, lvl.row_mask),
+            row1 = wrap(row + 1, lvl.height, lvl.row_mask);
+
+  return (1 - frac_x) * (1 - frac_y) * texel(lvl, row0, col0) +
+         frac_x * (1 - frac_y) * texel(lvl, row0, col1) +
+         (1 - frac_x) * frac_y * texel(lvl, row1, col0) +
+         frac_x * frac_y * texel(lvl, row1, col1);
+}
+
+colour mipmap::lookup(const real u, const real v, const real footprint) const {
+  if (empty()) {
+    // Return magenta to identify loading errors more easily
+    return colour(1.0, 0.0, 1.0);
+  }
+
+  const real clamped_u = std::clamp<real>(u, 0.0, 1.0);
+  const real clamped_v = std::clamp<real>(v, 0.0, 1.0);
+  // How many texels of the full resolution image the footprint covers.
+  // Level n's texels are 2^n times as wide.
+  const real texels = footprint * std::max(width(), height());
+  if (!(texels > 1.0))
+    return bilinear(m_levels[0], clamped_u, clamped_v);
+  const real lod =
+      std::min(std::log2(texels), static_cast<real>(m_levels.size() - 1));
+  const size_t lower = static_cast<size_t>(lod);
+  if (lower + 1 >= m_levels.size())
+    return bilinear(m_levels.back(), clamped_u, clamped_v);
+  const real t = lod - lower;
+  return (1 - t) * bilinear(m_levels[lower], clamped_u, clamped_v) +
+         t * bilinear(m_levels[lower + 1], clamped_u, clamped_v);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "colour.hpp"
+#include "util.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A texture image and a pyramid of successively half sized, box filtered
+// copies of it, kept in as few bytes as their source allows. Images from LDR
+// files keep their gamma encoded bytes, three per texel, and HDR images are
+// stored as half floats, where the float colours of an image would take 24
+// bytes per texel with doubles. Values too large for a half are clamped to
+// the largest one. HDR images loaded without a pyramid, such as environment
+// maps, keep full 32 bit floats instead, since a sun can be far brighter
+// than a half can hold and the light's importance sampling depends on it.
+//
+// Lookups are given the width of the area to filter over, in uv units, and
+// blend between the two levels whose texels are closest to that size, so
+// that minified textures neither alias nor touch more memory than they need.
+//
+// Each level is stored as square tiles of tile_size texels on a side, with
+// the tiles, and the texels within each tile, in row order. The four taps of
+// a bilinear lookup then usually land in the same tile, a few cache lines
+// apart, rather than in two rows a whole image width apart. Levels whose
+// sizes are powers of two wrap their texel indices with a mask.
+class mipmap {
+public:
+  enum class texel_format { rgb8, half, float32 };
+
+  static constexpr int log2_tile_size = 3;
+  static constexpr int tile_size = 1 << log2_tile_size;
+
+  // Only the full resolution level is kept when with_pyramid is false, for
+  // images which are never minified, such as environment maps
+  explicit mipmap(const std::string_view &filename,
+                  const bool with_pyramid = true);
+
+  // The texture at (u, v), averaged over a square footprint wide. A footprint
+  // of zero samples the full resolution image.
+  colour lookup(const real u, const real v, const real footprint) const;
+
+  inline bool empty() const { return m_levels.empty(); }
+  inline int width() const { return empty() ? 0 : m_levels[0].width; }
+  inline int height() const { return empty() ? 0 : m_levels[0].height; }
+  inline size_t num_levels() const { return m_levels.size(); }
+  // The texel at (row, col) of the full resolution level, where row 0 is the
+  // top of the image
+  inline colour get(const int row, const int col) const {
+    return texel(m_levels[0], row, col);
+  }
+  // The bytes taken up by the texels of every level
+  size_t memory_bytes() const;
+
+private:
+  struct level {
+    int width, height;
+    int tiles_per_row;
+    // width - 1 and height - 1 where they are powers of two, and -1 otherwise
+    int col_mask, row_mask;
+    // Where the level's first tile starts, in components
+    size_t offset;
+  };
+
+  texel_format m_format;
+  std::vector<level> m_levels;
+  // Only the vector for m_format is used. Row 0 is the top of the image,
+  // i.e. v = 1. Tiles on the right and bottom edges are padded out to full
+  // size.
+  std::vector<uint8_t> m_bytes;
+  std::vector<uint16_t> m_halves;
+  std::vector<float> m_floats;
+
+  // Where the texel at (row, col) starts, in components
+  static inline size_t texel_index(const level &lvl, const int row,
+                                   const int col) {
+    constexpr int within_tile = tile_size - 1;
+    const size_t tile =
+        static_cast<size_t>(row >> log2_tile_size) * lvl.tiles_per_row +
+        (col >> log2_tile_size);
+    return lvl.offset +
+           3 * ((tile << (2 * log2_tile_size)) +
+                ((row & within_tile) << log2_tile_size) + (col & within_tile));
+  }
+
+  colour texel(const level &lvl, const int row, const int col) const;
+  colour bilinear(const level &lvl, const real u, const real v) const;
+
+  void append_level(const std::vector<colour> &texels, const int width,
+                    const int height);
+};
@@ -1,10 +1,10 @@
 
-#include "bvh.hpp"
-#include "hittable_list.hpp"
+#include "obj_loader.hpp"
 #include "material.hpp"
 #include "material_manager.hpp"
-#include "triangle.hpp"
+#include "triangle_mesh.hpp"
 
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <filesystem>
 #include <fstream>
@@ -127,10 +127,9 @@ void load_mtl(const std::string_view &filename,
     materials[current_name] = current_material;
 }
 
-std::shared_ptr<bvh<>> load_obj(const std::string_view &filename,
-                                material *default_mat, const bool load_mtls) {
-  hittable_list result;
-
+std::shared_ptr<triangle_mesh> load_obj(const std::string_view &filename,
+                                        material *default_mat,
+                                        const bool load_mtls) {
   std::cout << "Loading OBJ file '" << filename << "'" << std::endl;
 
   std::string code, line;
@@ -140,13 +139,21 @@ std::shared_ptr<bvh<>> load_obj(const std::string_view &filename,
     throw std::runtime_error("OBJ loading failed: .obj file unreadable");
   }
 
-  std::vector<point3> positions(1); // Since OBJ is 1-indexed
-  std::vector<point3> uvs(1);
-  std::vector<vec3> normals(1);
+  // OBJ indices are 1-indexed, and are stored 0-indexed in the mesh
+  std::vector<point3> positions;
+  std::vector<vec3> uvs;
+  std::vector<vec3> normals;
+  std::vector<triangle_mesh::mesh_triangle> triangles;
 
   std::unordered_map<std::string, material *> materials;
   materials["default"] = default_mat;
-  material *current_material = default_mat;
+  // The mesh refers to materials by their index in mesh_materials
+  std::vector<material *> mesh_materials = {default_mat};
+  uint32_t current_material_idx = 0;
+
+  const auto &parse_index = [](const std::string &token) -> uint32_t {
+    return token.empty() ? triangle_mesh::no_index : std::stoi(token) - 1;
+  };
 
   std::vector<std::string> skipped_lines; // Just for reference
   std::unordered_set<std::string> ignored_codes = {"#", "s", "o", "g"};
@@ -168,7 +175,7 @@ std::shared_ptr<bvh<>> load_obj(const std::string_view &filename,
       ss >> pt.x >> pt.y >> pt.z;
       positions.push_back(pt);
     } else if (code == "vt") {
-      point3 uv;
+      vec3 uv;
       ss >> uv.x >> uv.y;
       uvs.push_back(uv);
     } else if (code == "vn") {
@@ -176,36 +183,36 @@ std::shared_ptr<bvh<>> load_obj(const std::string_view &filename,
       ss >> normal.x >> normal.y >> normal.z;
       normals.push_back(normal);
     } else if (code == "f") {
+      struct face_vertex {
+        uint32_t position_idx, uv_idx, normal_idx;
+      };
       std::string vertex_info;
-      std::vector<vertex> vertices;
+      std::vector<face_vertex> vertices;
 
       while (ss >> vertex_info) {
         std::vector<std::string> tokens;
         boost::split(tokens, vertex_info, boost::is_any_of("/"));
-
-        if (tokens.size() == 1) {
-          vertices.emplace_back(positions[std::stoi(tokens[0])]);
-        } else if (tokens.size() == 3) {
-          if (tokens[1] == "") {
-            const int position_idx = std::stoi(tokens[0]);
-            const int normal_idx = std::stoi(tokens[2]);
-            vertices.emplace_back(positions[position_idx], std::nullopt,
-                                  normals[normal_idx]);
-          } else {
-            const int position_idx = std::stoi(tokens[0]);
-            const int uv_idx = std::stoi(tokens[1]);
-            const int normal_idx = std::stoi(tokens[2]);
-            vertices.emplace_back(positions[position_idx], uvs[uv_idx],
-                                  normals[normal_idx]);
-          }
-        }
+        tokens.resize(3);
+        vertices.push_back({parse_index(tokens[0]), parse_index(tokens[1]),
+                            parse_index(tokens[2])});
       }
 
       const size_t num_points = vertices.size();
       for (size_t idx = 1; idx + 1 < num_points; ++idx) {
-        const vertex p0 = vertices[0], p1 = vertices[idx],
-                     p2 = vertices[idx + 1];
-        result.emplace_back<triangle>(p0, p1, p2, current_material);
+        const face_vertex p0 = vertices[0], p1 = vertices[idx],
+                          p2 = vertices[idx + 1];
+        triangle_mesh::mesh_triangle tri = {
+            {p0.position_idx, p1.position_idx, p2.position_idx},
+            {p0.normal_idx, p1.normal_idx, p2.normal_idx},
+            {p0.uv_idx, p1.uv_idx, p2.uv_idx},
+            current_material_idx};
+        // The mesh only interpolates attributes which all three corners have
+        for (uint32_t *indices : {tri.normal_idx, tri.uv_idx}) {
+          if (std::find(indices, indices + 3, triangle_mesh::no_index) !=
+              indices + 3)
+            std::fill(indices, indices + 3, triangle_mesh::no_index);
+        }
+        triangles.push_back(tri);
       }
     } else if (code == "mtllib") {
       std::string mtl_filename;
@@ -222,7 +229,12 @@ std::shared_ptr<bvh<>> load_obj(const std::string_view &filename,
                   << material_name << "'" << std::endl;
         throw std::runtime_error("Invalid .mtl file");
       }
-      current_material = materials[material_name];
+      material *const mat = materials[material_name];
+      const auto it =
+          std::find(mesh_materials.begin(), mesh_materials.end(), mat);
+      current_material_idx = it - mesh_materials.begin();
+      if (it == mesh_materials.end())
+        mesh_materials.push_back(mat);
     } else {
       std::cout << "OBJ: Ignored line '" << line << "'" << std::endl;
     }
@@ -235,10 +247,12 @@ std::shared_ptr<bvh<>> load_obj(const std::string_view &filename,
   }
 
   std::cout << "Loaded OBJ file: " << filename << std::endl;
-  std::cout << "  Triangles: " << result.size() << std::endl;
-  std::cout << "  Positions: " << positions.size() - 1 << std::endl;
-  std::cout << "  UV Coords: " << uvs.size() - 1 << std::endl;
-  std::cout << "  Normals  : " << normals.size() - 1 << std::endl;
+  std::cout << "  Triangles: " << triangles.size() << std::endl;
+  std::cout << "  Positions: " << positions.size() << std::endl;
+  std::cout << "  UV Coords: " << uvs.size() << std::endl;
+  std::cout << "  Normals  : " << normals.size() << std::endl;
 
-  return std::make_shared<bvh<>>(result, 0.0, 1.0);
+  return std::make_shared<triangle_mesh>(
+      std::move(positions), std::move(normals), std::move(uvs),
+      std::move(mesh_materials), std::move(triangles));
 }
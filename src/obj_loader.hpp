@@ -1,10 +1,11 @@
 
 #pragma once
 
-#include "bvh.hpp"
 #include "material.hpp"
+#include "triangle_mesh.hpp"
+#include <memory>
 #include <string_view>
 
-std::shared_ptr<bvh<>> load_obj(const std::string_view &filename,
-                                material *default_mat = nullptr,
-                                const bool load_mtls = true);
+std::shared_ptr<triangle_mesh> load_obj(const std::string_view &filename,
+                                        material *default_mat = nullptr,
+                                        const bool load_mtls = true);
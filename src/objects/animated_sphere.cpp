@@ -1,35 +1,37 @@
 
 #include "animated_sphere.hpp"
+#include "light_list.hpp"
 
 bool animated_sphere::hit(const ray &r, const real t_min, const real t_max,
                           hit_record &rec) const {
-  const point3 centre = get_centre(r.time);
-  const vec3 oc = r.orig - centre;
-  const real a = glm::dot(r.dir, r.dir);
-  const real half_b = glm::dot(oc, r.dir);
-  const real c = glm::dot(oc, oc) - m_radius * m_radius;
-
-  const real discriminant = half_b * half_b - a * c;
-  if (discriminant < 0.0)
+  real root;
+  if (!sphere::intersect(get_centre(r.time), m_radius, r, t_min, t_max, root))
     return false;
-  const real sqrtd = std::sqrt(discriminant);
+  rec.set_hit(this, 0, root);
+  return true;
+}
 
-  // Find the nearest root that lies in the acceptable range.
-  real root = (-half_b - sqrtd) / a;
-  if (root < t_min || t_max < root) {
-    root = (-half_b + sqrtd) / a;
-    if (root < t_min || t_max < root)
-      return false;
-  }
+bool animated_sphere::occluded(const ray &r, const real t_min,
+                               const real t_max) const {
+  real root;
+  return sphere::intersect(get_centre(r.time), m_radius, r, t_min, t_max,
+                           root);
+}
 
-  rec.t = root;
-  rec.p = r.at(rec.t);
-  const vec3 outward_normal = (rec.p - centre) / m_radius;
+void animated_sphere::compute_surface_interaction(const ray &r,
+                                                  hit_record &rec,
+                                                  const size_t path_idx) const {
+  const point3 centre = get_centre(r.time);
+  const vec3 outward_normal = glm::normalize(r.at(rec.t) - centre);
+  rec.p = centre + m_radius * outward_normal;
+  rec.p_error = util::gamma(6) *
+                (glm::abs(m_radius * outward_normal) + glm::abs(centre));
+  rec.geometric_normal = outward_normal;
   rec.set_face_normal(r, outward_normal);
   sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+  sphere::get_sphere_uv_derivatives(outward_normal, m_radius, rec.dpdu,
+                                    rec.dpdv);
   rec.mat_ptr = m_mat_ptr;
-
-  return true;
 }
 
 inline bool animated_sphere::bounding_box(const real time0, const real time1,
@@ -37,4 +39,14 @@ inline bool animated_sphere::bounding_box(const real time0, const real time1,
   output_box = aabb(glm::min(m_centre0, m_centre1) - vec3(m_radius),
                     glm::max(m_centre0, m_centre1) + vec3(m_radius));
   return true;
-}
\ No newline at end of file
+}
+
+void animated_sphere::gather_lights(
+    light_list &lights, const mat4 &model_matrix,
+    std::vector<hit_record::path_entry> &outer_path) const {
+  if (!m_mat_ptr->is_emissive())
+    return;
+  lights.add(light_list::emitter::sphere(m_centre0, m_centre1, m_time0,
+                                         m_time1, m_radius, m_mat_ptr),
+             this, 0, model_matrix, outer_path);
+}
@@ -22,11 +22,19 @@ struct animated_sphere : public hittable {
 
   virtual bool hit(const ray &r, const real t_min, const real t_max,
                    hit_record &rec) const override;
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override;
+  virtual void
+  compute_surface_interaction(const ray &r, hit_record &rec,
+                              const size_t path_idx) const override;
+  virtual void
+  gather_lights(light_list &lights, const mat4 &model_matrix,
+                std::vector<hit_record::path_entry> &outer_path) const override;
   virtual bool bounding_box(const real time0, const real time1,
                             aabb &output_box) const override;
 
   constexpr inline point3 get_centre(const real time) const {
     const real t = (time - m_time0) / (m_time1 - m_time0);
-    return (1.0 - t) * m_centre0 + t * m_centre1;
+    return (real(1.0) - t) * m_centre0 + t * m_centre1;
   }
 };
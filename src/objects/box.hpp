@@ -39,6 +39,17 @@ struct box : public hittable {
     return m_objects.hit(r, t_min, t_max, rec);
   }
 
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override {
+    return m_objects.occluded(r, t_min, t_max);
+  }
+
+  virtual void gather_lights(
+      light_list &lights, const mat4 &model_matrix,
+      std::vector<hit_record::path_entry> &outer_path) const override {
+    m_objects.gather_lights(lights, model_matrix, outer_path);
+  }
+
   virtual bool bounding_box(const real time0, const real time1,
                             aabb &output_box) const override {
     output_box = m_bounding_box;
@@ -1,19 +1,30 @@
 
 #pragma once
 
+#include "bvh_node.hpp"
 #include "hittable.hpp"
 #include "hittable_list.hpp"
 #include "util.hpp"
 
 #include <algorithm>
+#include <array>
 #include <cmath>
+#include <atomic>
 #include <stdexcept>
 #include <vector>
 
+#include <omp.h>
+
 enum bvh_split_strategy {
   EqualParts,
   HalveLongestAxis,
   SAH,
+  BinnedSAH,
+};
+
+enum bvh_traversal_strategy {
+  RecursiveTraversal,
+  IterativeTraversal,
 };
 
 template <bvh_split_strategy split_strategy = SAH>
@@ -56,31 +67,99 @@ struct bvh : public hittable {
   std::vector<std::shared_ptr<hittable>> m_primitives;
   std::vector<aabb> m_bounding_boxes;
   std::vector<bvh_entry> m_entries;
+  // A compact copy of m_entries used by the iterative traversal
+  std::vector<bvh_node> m_nodes;
+  bvh_traversal_strategy m_traversal;
+  size_t m_max_depth = 0;
+
+  // The iterative traversal keeps at most one pending entry per level
+  static constexpr size_t max_stack_depth = 64;
+
+  // Subtrees smaller than this, or deeper than max_parallel_depth, are built
+  // serially inside a single task
+  static constexpr size_t min_parallel_span = 4096;
+  static constexpr size_t max_parallel_depth = 12;
 
 public:
   bvh(const hittable_list &lst, const real time0, const real time1,
-      const size_t max_nodes_per_leaf = 16)
-      : bvh(lst.m_objects, time0, time1, max_nodes_per_leaf) {}
+      const size_t max_nodes_per_leaf = 16,
+      const bvh_traversal_strategy traversal = IterativeTraversal)
+      : bvh(lst.m_objects, time0, time1, max_nodes_per_leaf, traversal) {}
   bvh(const std::vector<std::shared_ptr<hittable>> &objects, const real time0,
-      const real time1, const size_t max_nodes_per_leaf);
+      const real time1, const size_t max_nodes_per_leaf,
+      const bvh_traversal_strategy traversal = IterativeTraversal);
 
   virtual ~bvh() {}
 
-  void recursive_build(std::vector<bvh_build_data> &data,
-                       const size_t entry_idx, const size_t start,
-                       const size_t end, const real time0, const real time1,
-                       const size_t max_nodes_per_leaf);
+  // Builds the subtree over data[start, end) rooted at entries[entry_idx],
+  // appending every other entry of the subtree to entries
+  static void recursive_build(std::vector<bvh_build_data> &data,
+                              std::vector<bvh_entry> &entries,
+                              const size_t entry_idx, const size_t start,
+                              const size_t end,
+                              const size_t max_nodes_per_leaf);
+
+  // Builds the subtree over data[start, end) into its own node range, with
+  // its root first and child indices relative to that range. The top levels
+  // are split across OpenMP tasks and their ranges are stitched together.
+  // Must be called from within a parallel region. build_ns accumulates the
+  // CPU time spent building across all tasks.
+  static std::vector<bvh_entry>
+  parallel_build(std::vector<bvh_build_data> &data, const size_t start,
+                 const size_t end, const size_t max_nodes_per_leaf,
+                 const size_t depth, std::atomic<long long> &build_ns);
+
+  // Builds a tree over data, reordering it so that every leaf covers a
+  // contiguous range of it
+  static std::vector<bvh_entry> build(std::vector<bvh_build_data> &data,
+                                      const size_t max_nodes_per_leaf,
+                                      std::atomic<long long> &build_ns);
+
+  // Converts entries into compact nodes once every leaf refers to the final
+  // order of the primitives
+  static std::vector<bvh_node> flatten(const std::vector<bvh_entry> &entries,
+                                       const size_t num_primitives);
+
+  static size_t max_depth(const std::vector<bvh_entry> &entries);
 
   bool recursive_hit(const ray &r, const size_t idx, const real t_min,
                      const real t_max, hit_record &rec) const;
 
+  bool iterative_hit(const ray &r, const real t_min, const real t_max,
+                     hit_record &rec) const;
+
+  bool recursive_occluded(const ray &r, const size_t idx, const real t_min,
+                          const real t_max) const;
+
+  bool iterative_occluded(const ray &r, const real t_min,
+                          const real t_max) const;
+
   virtual bool hit(const ray &r, const real t_min, const real t_max,
                    hit_record &rec) const override {
     if (m_entries.empty())
       return false;
+    // Trees deeper than the fixed-size stack fall back to recursion
+    if (m_traversal == IterativeTraversal && m_max_depth < max_stack_depth)
+      return iterative_hit(r, t_min, t_max, rec);
     return recursive_hit(r, 0, t_min, t_max, rec);
   }
 
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override {
+    if (m_entries.empty())
+      return false;
+    if (m_traversal == IterativeTraversal && m_max_depth < max_stack_depth)
+      return iterative_occluded(r, t_min, t_max);
+    return recursive_occluded(r, 0, t_min, t_max);
+  }
+
+  virtual void gather_lights(
+      light_list &lights, const mat4 &model_matrix,
+      std::vector<hit_record::path_entry> &outer_path) const override {
+    for (const auto &primitive : m_primitives)
+      primitive->gather_lights(lights, model_matrix, outer_path);
+  }
+
   virtual bool bounding_box(const real time0, const real time1,
                             aabb &output_box) const override {
     if (m_entries.empty())
@@ -90,9 +169,9 @@ public:
   }
 
 private:
-  std::pair<size_t, size_t> split(std::vector<bvh_build_data> &data,
-                                  const size_t start, const size_t end,
-                                  const aabb &total_bounding_box) const;
+  static std::pair<size_t, size_t> split(std::vector<bvh_build_data> &data,
+                                         const size_t start, const size_t end,
+                                         const aabb &total_bounding_box);
 };
 
 // ============================= IMPLEMENTATION =============================
@@ -100,8 +179,9 @@ private:
 template <bvh_split_strategy strategy>
 bvh<strategy>::bvh(const std::vector<std::shared_ptr<hittable>> &objects,
                    const real time0, const real time1,
-                   size_t max_nodes_per_leaf)
-    : m_primitives(), m_entries() {
+                   size_t max_nodes_per_leaf,
+                   const bvh_traversal_strategy traversal)
+    : m_primitives(), m_entries(), m_traversal(traversal) {
   max_nodes_per_leaf = std::min<size_t>(max_nodes_per_leaf, 255);
   const auto start_ns = util::get_time_ns();
 
@@ -119,8 +199,10 @@ bvh<strategy>::bvh(const std::vector<std::shared_ptr<hittable>> &objects,
     total_bounding_box.merge(bounding_box);
   }
 
-  m_entries.emplace_back(); // Root
-  recursive_build(data, 0, 0, data.size(), time0, time1, max_nodes_per_leaf);
+  std::atomic<long long> build_ns = 0;
+  const auto build_start_ns = util::get_time_ns();
+  m_entries = build(data, max_nodes_per_leaf, build_ns);
+  const auto build_end_ns = util::get_time_ns();
 
   for (bvh_entry &entry : m_entries) {
     if (entry.is_leaf) {
@@ -134,22 +216,87 @@ bvh<strategy>::bvh(const std::vector<std::shared_ptr<hittable>> &objects,
       entry.primitive_end = m_primitives.size();
     }
   }
+  m_nodes = flatten(m_entries, m_primitives.size());
+  m_max_depth = max_depth(m_entries);
 
   const auto end_ns = util::get_time_ns();
   const real total_seconds = (end_ns - start_ns) / 1e9;
 
+  // CPU time summed over every task, divided by the build's wall time. This
+  // is how busy the threads were, task and stitching overhead included, not
+  // a speedup over a serial build.
+  const long long build_wall_ns = build_end_ns - build_start_ns;
+  const real utilisation =
+      static_cast<real>(build_ns) / std::max<long long>(build_wall_ns, 1);
+
   std::cout << "Finished constructing a BVH on a list of " << objects.size()
             << " items" << std::endl;
   std::cout << "  " << total_seconds << " seconds" << std::endl;
+  std::cout << "  " << utilisation << "x CPU time / wall time on "
+            << omp_get_max_threads() << " threads" << std::endl;
   std::cout << "  " << m_primitives.size() << " primitives" << std::endl;
   std::cout << "  " << m_entries.size() << " nodes" << std::endl;
+  std::cout << "  " << m_max_depth << " max depth" << std::endl;
+}
+
+template <bvh_split_strategy strategy>
+std::vector<typename bvh<strategy>::bvh_entry>
+bvh<strategy>::build(std::vector<bvh_build_data> &data,
+                     const size_t max_nodes_per_leaf,
+                     std::atomic<long long> &build_ns) {
+  std::vector<bvh_entry> entries;
+#pragma omp parallel
+#pragma omp single
+  entries =
+      parallel_build(data, 0, data.size(), max_nodes_per_leaf, 0, build_ns);
+  return entries;
+}
+
+template <bvh_split_strategy strategy>
+std::vector<bvh_node>
+bvh<strategy>::flatten(const std::vector<bvh_entry> &entries,
+                       const size_t num_primitives) {
+  if (entries.size() >= bvh_node::leaf_flag ||
+      num_primitives >= bvh_node::leaf_flag)
+    throw std::runtime_error("BVH is too large to flatten");
+
+  std::vector<bvh_node> nodes;
+  nodes.reserve(entries.size());
+  for (const bvh_entry &entry : entries) {
+    if (entry.is_leaf) {
+      nodes.push_back(bvh_node::leaf(
+          entry.bounding_box, entry.primitive_start,
+          entry.primitive_end - entry.primitive_start));
+    } else {
+      nodes.push_back(
+          bvh_node::interior(entry.bounding_box, entry.left_child, entry.axis));
+    }
+  }
+  return nodes;
+}
+
+template <bvh_split_strategy strategy>
+size_t bvh<strategy>::max_depth(const std::vector<bvh_entry> &entries) {
+  // Children are always stored after their parents, so a single forward pass
+  // is enough to find the depth of every entry
+  size_t result = 0;
+  std::vector<size_t> depths(entries.size(), 0);
+  for (size_t idx = 0; idx < entries.size(); ++idx) {
+    const bvh_entry &entry = entries[idx];
+    result = std::max(result, depths[idx]);
+    if (!entry.is_leaf) {
+      depths[entry.left_child] = depths[idx] + 1;
+      depths[entry.left_child + 1] = depths[idx] + 1;
+    }
+  }
+  return result;
 }
 
 template <>
 inline std::pair<size_t, size_t>
 bvh<HalveLongestAxis>::split(std::vector<bvh_build_data> &data,
                              const size_t start, const size_t end,
-                             const aabb &total_bounding_box) const {
+                             const aabb &total_bounding_box) {
   const size_t axis = total_bounding_box.largest_axis();
   const auto &cmp_to_center = [axis,
                                total_bounding_box](const bvh_build_data &a) {
@@ -175,7 +322,7 @@ bvh<HalveLongestAxis>::split(std::vector<bvh_build_data> &data,
 template <>
 inline std::pair<size_t, size_t>
 bvh<EqualParts>::split(std::vector<bvh_build_data> &data, const size_t start,
-                       const size_t end, const aabb &total_bounding_box) const {
+                       const size_t end, const aabb &total_bounding_box) {
   const size_t axis = total_bounding_box.largest_axis();
   const auto &cmp = [axis](const bvh_build_data &a, const bvh_build_data &b) {
     return a.centroid[axis] < b.centroid[axis];
@@ -189,7 +336,7 @@ bvh<EqualParts>::split(std::vector<bvh_build_data> &data, const size_t start,
 template <>
 inline std::pair<size_t, size_t>
 bvh<SAH>::split(std::vector<bvh_build_data> &data, const size_t start,
-                const size_t end, const aabb &total_bounding_box) const {
+                const size_t end, const aabb &total_bounding_box) {
   size_t best_mid = -1, best_axis = -1;
   real best_cost = inf;
 
@@ -248,11 +395,107 @@ bvh<SAH>::split(std::vector<bvh_build_data> &data, const size_t start,
   return std::make_pair(best_mid, best_axis);
 }
 
+template <>
+inline std::pair<size_t, size_t>
+bvh<BinnedSAH>::split(std::vector<bvh_build_data> &data, const size_t start,
+                      const size_t end, const aabb &total_bounding_box) {
+  // All scratch space lives on the stack, so no allocations happen per node
+  constexpr size_t num_bins = 32;
+  struct bin {
+    aabb bounding_box;
+    size_t count = 0;
+  };
+
+  // Primitives are binned by centroid, so only the centroids' extent matters
+  aabb centroid_bounds;
+  for (size_t idx = start; idx < end; ++idx)
+    centroid_bounds.merge(data[idx].centroid);
+  const vec3 extent = centroid_bounds.max - centroid_bounds.min;
+
+  const auto &bin_index = [&centroid_bounds, &extent](const vec3 &centroid,
+                                                      const size_t axis) {
+    const real offset = centroid[axis] - centroid_bounds.min[axis];
+    const size_t idx = static_cast<size_t>(num_bins * offset / extent[axis]);
+    return std::min(idx, num_bins - 1);
+  };
+
+  size_t best_bin = num_bins, best_axis = 0;
+  real best_cost = inf;
+
+  // 1. For each axis with a non-degenerate centroid extent:
+  for (size_t axis = 0; axis < 3; ++axis) {
+    if (extent[axis] <= 0.0)
+      continue;
+
+    // a. Count the primitives and their bounds in each bin
+    std::array<bin, num_bins> bins;
+    for (size_t idx = start; idx < end; ++idx) {
+      bin &b = bins[bin_index(data[idx].centroid, axis)];
+      b.bounding_box.merge(data[idx].bounding_box);
+      b.count++;
+    }
+
+    // b. suffix_areas[idx] and suffix_counts[idx] describe bins [idx, end)
+    std::array<real, num_bins> suffix_areas;
+    std::array<size_t, num_bins> suffix_counts;
+    aabb suffix_box;
+    size_t suffix_count = 0;
+    for (int idx = num_bins - 1; idx > 0; --idx) {
+      suffix_box.merge(bins[idx].bounding_box);
+      suffix_count += bins[idx].count;
+      suffix_areas[idx] = suffix_box.surface_area();
+      suffix_counts[idx] = suffix_count;
+    }
+
+    // c. Sweep from the left, evaluating the split after every bin
+    aabb prefix_box;
+    size_t prefix_count = 0;
+    for (size_t idx = 0; idx + 1 < num_bins; ++idx) {
+      prefix_box.merge(bins[idx].bounding_box);
+      prefix_count += bins[idx].count;
+      if (prefix_count == 0 || suffix_counts[idx + 1] == 0)
+        continue;
+
+      const real prefix_cost = prefix_count * prefix_box.surface_area();
+      const real suffix_cost = suffix_counts[idx + 1] * suffix_areas[idx + 1];
+      const real cost = 0.125 + (prefix_cost + suffix_cost) /
+                                    total_bounding_box.surface_area();
+      if (cost < best_cost) {
+        best_bin = idx;
+        best_axis = axis;
+        best_cost = cost;
+      }
+    }
+  }
+
+  // 2. If every centroid coincides, fall back to splitting into equal parts
+  if (best_bin == num_bins) {
+    const size_t axis = total_bounding_box.largest_axis();
+    const size_t mid = start + (end - start) / 2;
+    const auto &cmp = [axis](const bvh_build_data &a, const bvh_build_data &b) {
+      return a.centroid[axis] < b.centroid[axis];
+    };
+    std::nth_element(data.begin() + start, data.begin() + mid,
+                     data.begin() + end, cmp);
+    return std::make_pair(mid, axis);
+  }
+
+  // 3. Otherwise partition around the chosen bin boundary
+  const auto &in_left = [&bin_index, best_bin,
+                         best_axis](const bvh_build_data &a) {
+    return bin_index(a.centroid, best_axis) <= best_bin;
+  };
+  const size_t mid =
+      std::partition(data.begin() + start, data.begin() + end, in_left) -
+      data.begin();
+  return std::make_pair(mid, best_axis);
+}
+
 template <bvh_split_strategy strategy>
 void bvh<strategy>::recursive_build(std::vector<bvh_build_data> &data,
+                                    std::vector<bvh_entry> &entries,
                                     const size_t entry_idx, const size_t start,
-                                    const size_t end, const real time0,
-                                    const real time1,
+                                    const size_t end,
                                     const size_t max_nodes_per_leaf) {
   const size_t span = end - start;
   aabb total_bounding_box;
@@ -260,22 +503,79 @@ void bvh<strategy>::recursive_build(std::vector<bvh_build_data> &data,
     total_bounding_box.merge(data[idx].bounding_box);
 
   if (span <= max_nodes_per_leaf) {
-    m_entries[entry_idx].construct_leaf(total_bounding_box, start, end);
+    entries[entry_idx].construct_leaf(total_bounding_box, start, end);
     return;
   }
 
   const auto &[mid, axis] = split(data, start, end, total_bounding_box);
 
-  const size_t left_entry_idx = m_entries.size(),
+  const size_t left_entry_idx = entries.size(),
                right_entry_idx = left_entry_idx + 1;
-  m_entries.emplace_back(); // Left
-  m_entries.emplace_back(); // Right
-  recursive_build(data, left_entry_idx, start, mid, time0, time1,
+  entries.emplace_back(); // Left
+  entries.emplace_back(); // Right
+  recursive_build(data, entries, left_entry_idx, start, mid,
                   max_nodes_per_leaf);
-  recursive_build(data, right_entry_idx, mid, end, time0, time1,
+  recursive_build(data, entries, right_entry_idx, mid, end,
                   max_nodes_per_leaf);
-  m_entries[entry_idx].construct_non_leaf(total_bounding_box, left_entry_idx,
-                                          axis);
+  entries[entry_idx].construct_non_leaf(total_bounding_box, left_entry_idx,
+                                        axis);
+}
+
+template <bvh_split_strategy strategy>
+std::vector<typename bvh<strategy>::bvh_entry> bvh<strategy>::parallel_build(
+    std::vector<bvh_build_data> &data, const size_t start, const size_t end,
+    const size_t max_nodes_per_leaf, const size_t depth,
+    std::atomic<long long> &build_ns) {
+  const auto start_ns = util::get_thread_time_ns();
+  const size_t span = end - start;
+  std::vector<bvh_entry> entries(1); // Root
+
+  if (span < min_parallel_span || depth >= max_parallel_depth) {
+    recursive_build(data, entries, 0, start, end, max_nodes_per_leaf);
+    build_ns += util::get_thread_time_ns() - start_ns;
+    return entries;
+  }
+
+  aabb total_bounding_box;
+  for (size_t idx = start; idx < end; ++idx)
+    total_bounding_box.merge(data[idx].bounding_box);
+  const auto &[mid, axis] = split(data, start, end, total_bounding_box);
+  build_ns += util::get_thread_time_ns() - start_ns;
+
+  // Both halves touch disjoint ranges of data, so they can be built at once
+  std::vector<bvh_entry> left, right;
+  const size_t split_mid = mid;
+#pragma omp task shared(data, left, build_ns)
+  left = parallel_build(data, start, split_mid, max_nodes_per_leaf, depth + 1,
+                        build_ns);
+#pragma omp task shared(data, right, build_ns)
+  right = parallel_build(data, split_mid, end, max_nodes_per_leaf, depth + 1,
+                         build_ns);
+#pragma omp taskwait
+
+  // Stitch the ranges together as [root, left root, right root, rest of left,
+  // rest of right], which keeps both children of every entry adjacent
+  const auto stitch_start_ns = util::get_thread_time_ns();
+  entries[0].construct_non_leaf(total_bounding_box, 1, axis);
+  entries.reserve(1 + left.size() + right.size());
+  const auto &append = [&entries](const std::vector<bvh_entry> &subtree,
+                                  const size_t root_idx, const size_t offset) {
+    // Local index 0 moves to root_idx, local index k > 0 moves to k + offset
+    for (size_t idx = 0; idx < subtree.size(); ++idx) {
+      bvh_entry entry = subtree[idx];
+      if (!entry.is_leaf)
+        entry.left_child += offset;
+      if (idx == 0)
+        entries[root_idx] = entry;
+      else
+        entries.push_back(entry);
+    }
+  };
+  entries.resize(3);
+  append(left, 1, 2);
+  append(right, 2, left.size() + 1);
+  build_ns += util::get_thread_time_ns() - stitch_start_ns;
+  return entries;
 }
 
 template <bvh_split_strategy strategy>
@@ -318,3 +618,63 @@ bool bvh<strategy>::recursive_hit(const ray &r, const size_t idx,
     }
   }
 }
+
+template <bvh_split_strategy strategy>
+bool bvh<strategy>::iterative_hit(const ray &r, const real t_min,
+                                  const real t_max, hit_record &rec) const {
+  return traverse_nodes<max_stack_depth>(
+      m_nodes, r, t_min, t_max,
+      [&](const uint32_t prim_start, const uint32_t prim_end,
+          real &closest_so_far) {
+        bool hit_anything = false;
+        for (size_t prim_idx = prim_start; prim_idx < prim_end; ++prim_idx) {
+          const std::shared_ptr<hittable> &object = m_primitives[prim_idx];
+          const aabb &box = m_bounding_boxes[prim_idx];
+          if (!box.does_hit(r, t_min, closest_so_far))
+            continue;
+          if (object->hit(r, t_min, closest_so_far, rec)) {
+            hit_anything = true;
+            closest_so_far = rec.t;
+          }
+        }
+        return hit_anything;
+      });
+}
+
+template <bvh_split_strategy strategy>
+bool bvh<strategy>::recursive_occluded(const ray &r, const size_t idx,
+                                       const real t_min,
+                                       const real t_max) const {
+  const bvh_entry &entry = m_entries[idx];
+  if (!entry.bounding_box.does_hit(r, t_min, t_max))
+    return false;
+
+  if (entry.is_leaf) {
+    for (size_t prim_idx = entry.primitive_start;
+         prim_idx < entry.primitive_end; ++prim_idx) {
+      if (m_bounding_boxes[prim_idx].does_hit(r, t_min, t_max) &&
+          m_primitives[prim_idx]->occluded(r, t_min, t_max))
+        return true;
+    }
+    return false;
+  }
+  // Any hit will do, so the order of the children doesn't matter
+  return recursive_occluded(r, entry.left_child, t_min, t_max) ||
+         recursive_occluded(r, entry.left_child + 1, t_min, t_max);
+}
+
+template <bvh_split_strategy strategy>
+bool bvh<strategy>::iterative_occluded(const ray &r, const real t_min,
+                                       const real t_max) const {
+  return traverse_nodes<max_stack_depth, true>(
+      m_nodes, r, t_min, t_max,
+      [&](const uint32_t prim_start, const uint32_t prim_end,
+          real &closest_so_far) {
+        for (size_t prim_idx = prim_start; prim_idx < prim_end; ++prim_idx) {
+          if (m_bounding_boxes[prim_idx].does_hit(r, t_min, t_max) &&
+              m_primitives[prim_idx]->occluded(r, t_min, t_max))
+            return true;
+        }
+        return false;
+      });
+}
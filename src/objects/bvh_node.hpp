@@ -0,0 +1,167 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "util.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Rounds a real to the nearest float which is no greater (resp. no smaller)
+// than it, so that boxes never shrink when stored in single precision
+inline float round_down_to_float(const real x) {
+  const float f = static_cast<float>(x);
+  return static_cast<real>(f) > x
+             ? std::nextafter(f, -std::numeric_limits<float>::infinity())
+             : f;
+}
+
+inline float round_up_to_float(const real x) {
+  const float f = static_cast<float>(x);
+  return static_cast<real>(f) < x
+             ? std::nextafter(f, std::numeric_limits<float>::infinity())
+             : f;
+}
+
+// A flattened BVH node which fits in half a cache line.
+//  - Interior nodes store the index of their left child in offset, the right
+//    child immediately follows it, and the split axis in count.
+//  - Leaves store their first primitive in offset and the number of
+//    primitives in count, with the leaf flag packed into the top bit.
+struct alignas(32) bvh_node {
+  float min[3];
+  uint32_t offset;
+  float max[3];
+  uint32_t count;
+
+  static constexpr uint32_t leaf_flag = 0x80000000u;
+
+  bvh_node() = default;
+  bvh_node(const aabb &box, const uint32_t offset, const uint32_t count)
+      : min{round_down_to_float(box.min.x), round_down_to_float(box.min.y),
+            round_down_to_float(box.min.z)},
+        offset(offset),
+        max{round_up_to_float(box.max.x), round_up_to_float(box.max.y),
+            round_up_to_float(box.max.z)},
+        count(count) {}
+
+  static bvh_node leaf(const aabb &box, const uint32_t primitive_start,
+                       const uint32_t num_primitives) {
+    return bvh_node(box, primitive_start, num_primitives | leaf_flag);
+  }
+
+  static bvh_node interior(const aabb &box, const uint32_t left_child,
+                           const uint32_t axis) {
+    return bvh_node(box, left_child, axis);
+  }
+
+  constexpr inline bool is_leaf() const { return (count & leaf_flag) != 0; }
+  constexpr inline uint32_t left_child() const { return offset; }
+  constexpr inline uint32_t right_child() const { return offset + 1; }
+  constexpr inline uint32_t axis() const { return count; }
+  constexpr inline uint32_t primitive_start() const { return offset; }
+  constexpr inline uint32_t primitive_end() const {
+    return offset + (count & ~leaf_flag);
+  }
+
+  aabb bounding_box() const {
+    return aabb(point3(min[0], min[1], min[2]), point3(max[0], max[1], max[2]));
+  }
+
+  // Slab test with a precomputed reciprocal direction, with output variable
+  // t_enter set to the distance at which the ray enters the node
+  inline bool hit(const point3 &orig, const vec3 &inv_dir, const real t_min,
+                  const real t_max, real &t_enter) const {
+    const vec3 ray_hit_min = (point3(min[0], min[1], min[2]) - orig) * inv_dir,
+               ray_hit_max = (point3(max[0], max[1], max[2]) - orig) * inv_dir;
+    const vec3 left_endpoints = glm::min(ray_hit_min, ray_hit_max);
+    const vec3 right_endpoints = glm::max(ray_hit_min, ray_hit_max);
+    const real left = std::max(std::max(left_endpoints.x, left_endpoints.y),
+                               std::max(left_endpoints.z, t_min));
+    const real right = std::min(std::min(right_endpoints.x, right_endpoints.y),
+                                std::min(right_endpoints.z, t_max));
+    t_enter = left;
+    return right > left;
+  }
+};
+
+static_assert(sizeof(bvh_node) == 32, "bvh_node should be 32 bytes");
+
+// Walks a flattened tree front to back with a fixed-size stack, so the tree
+// must be shallower than max_stack_depth. Both children of an interior node
+// are tested together, the nearer one is visited first and deferred subtrees
+// which start beyond the closest hit so far are skipped.
+//
+// hit_leaf(primitive_start, primitive_end, closest_so_far) is called for
+// every leaf the ray reaches, and should return true and lower closest_so_far
+// when it finds a closer hit. With any_hit set, the traversal instead stops
+// as soon as any leaf returns true.
+template <size_t max_stack_depth, bool any_hit = false, class LeafFunction>
+inline bool traverse_nodes(const std::vector<bvh_node> &nodes, const ray &r,
+                           const real t_min, const real t_max,
+                           LeafFunction &&hit_leaf) {
+  // Every entry on the stack has already had its bounding box tested, so we
+  // only keep the distance at which the ray enters it
+  struct stack_entry {
+    uint32_t idx;
+    real t_enter;
+  };
+  std::array<stack_entry, max_stack_depth> stack;
+  size_t stack_size = 0;
+
+  const vec3 inv_dir = vec3(1.0) / r.dir;
+  real t_root;
+  if (nodes.empty() || !nodes[0].hit(r.orig, inv_dir, t_min, t_max, t_root))
+    return false;
+
+  bool hit_anything = false;
+  real closest_so_far = t_max;
+  uint32_t idx = 0;
+  while (true) {
+    const bvh_node &node = nodes[idx];
+    if (node.is_leaf()) {
+      if (hit_leaf(node.primitive_start(), node.primitive_end(),
+                   closest_so_far)) {
+        if constexpr (any_hit)
+          return true;
+        hit_anything = true;
+      }
+    } else {
+      const uint32_t left_idx = node.left_child(),
+                     right_idx = node.right_child();
+      real t_left, t_right;
+      const bool hit_left = nodes[left_idx].hit(r.orig, inv_dir, t_min,
+                                                closest_so_far, t_left);
+      const bool hit_right = nodes[right_idx].hit(r.orig, inv_dir, t_min,
+                                                  closest_so_far, t_right);
+      if (hit_left && hit_right) {
+        const bool left_first = t_left <= t_right;
+        stack[stack_size++] = left_first ? stack_entry{right_idx, t_right}
+                                         : stack_entry{left_idx, t_left};
+        idx = left_first ? left_idx : right_idx;
+        continue;
+      } else if (hit_left) {
+        idx = left_idx;
+        continue;
+      } else if (hit_right) {
+        idx = right_idx;
+        continue;
+      }
+    }
+
+    // Pop until we find a subtree which starts before the closest hit so far
+    bool found_next = false;
+    while (stack_size > 0) {
+      const stack_entry &next = stack[--stack_size];
+      if (next.t_enter <= closest_so_far) {
+        idx = next.idx;
+        found_next = true;
+        break;
+      }
+    }
+    if (!found_next)
+      return hit_anything;
+  }
+}
@@ -4,15 +4,126 @@
 #include "aabb.hpp"
 #include "util.hpp"
 
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
 struct material;
+class hittable;
+class light_list;
 
 struct hit_record {
+  // Every object between the world and the closest primitive which changes
+  // space (e.g. an instance's transform), along with an object-specific id.
+  // path[0] is the primitive itself, and the outermost object comes last.
+  struct path_entry {
+    const hittable *object;
+    uint32_t id;
+  };
+  static constexpr size_t max_path_length = 4;
+
+  // Filled in by hittable::hit
+  real t;
+  real b1, b2; // Barycentric coordinates, for primitives which have them
+  std::array<path_entry, max_path_length> path;
+  size_t path_length = 0;
+
+  // Filled in by compute_surface_interaction. Each coordinate of p is within
+  // p_error of the true surface. The geometric normal is the unit outward
+  // normal of the surface itself, while normal is the shading normal, flipped
+  // to face against the ray.
   point3 p;
+  vec3 p_error;
+  vec3 geometric_normal;
   vec3 normal;
   material *mat_ptr;
-  real t;
   real u, v;
   bool front_face;
+  // How p moves with u and v, for working out how much of a texture a ray's
+  // footprint covers. Left at zero by primitives without a parametrization,
+  // whose textures are then sampled at full resolution.
+  vec3 dpdu = vec3(0.0), dpdv = vec3(0.0);
+
+  // Filled in by the integrator: the width of the ray's footprint at p,
+  // measured in uv units. Zero means a point sample.
+  real uv_footprint = 0.0;
+
+  // Called by a primitive when it finds a closer hit
+  inline void set_hit(const hittable *object, const uint32_t id,
+                      const real hit_t, const real hit_b1 = 0.0,
+                      const real hit_b2 = 0.0) {
+    t = hit_t;
+    b1 = hit_b1;
+    b2 = hit_b2;
+    path[0] = {object, id};
+    path_length = 1;
+  }
+
+  // Called by an object which changes space once one of its children reports
+  // a closer hit
+  inline void push_path(const hittable *object, const uint32_t id) {
+    assert(path_length < max_path_length);
+    path[path_length++] = {object, id};
+  }
+
+  // Fills in the rest of the record for the closest hit along r
+  inline void compute_surface_interaction(const ray &r);
+
+  // Starts a ray at p in the given direction, nudged off the surface on the
+  // side that the direction leaves from so that it cannot hit it again
+  inline ray spawn_ray(const vec3 &direction, const real time) const {
+    const vec3 n = glm::dot(direction, geometric_normal) > 0.0
+                       ? geometric_normal
+                       : -geometric_normal;
+    return ray(util::offset_ray_origin(p, p_error, n), direction, time);
+  }
+
+  // Starts a ray at p towards target, a point on another surface with error
+  // target_error and unit geometric normal target_normal. Both ends are
+  // nudged off their surfaces, and the ray reaches the target at t = 1.
+  inline ray spawn_ray_to(const point3 &target, const vec3 &target_error,
+                          const vec3 &target_normal, const real time) const {
+    const vec3 direction = target - p;
+    const vec3 n = glm::dot(direction, geometric_normal) > 0.0
+                       ? geometric_normal
+                       : -geometric_normal;
+    const vec3 target_n = glm::dot(direction, target_normal) > 0.0
+                              ? -target_normal
+                              : target_normal;
+    const point3 origin = util::offset_ray_origin(p, p_error, n);
+    const point3 end = util::offset_ray_origin(target, target_error, target_n);
+    return ray(origin, end - origin, time);
+  }
+
+  // Sets dpdu and dpdv for a flat patch whose edges edge1 and edge2 span
+  // duv1 and duv2 of the uv plane. Degenerate uv's leave them at zero.
+  inline void set_uv_derivatives(const vec3 &edge1, const vec3 &edge2,
+                                 const vec3 &duv1, const vec3 &duv2) {
+    const real determinant = duv1.x * duv2.y - duv1.y * duv2.x;
+    if (determinant == 0.0) {
+      dpdu = dpdv = vec3(0.0);
+      return;
+    }
+    const real inv_determinant = real(1.0) / determinant;
+    dpdu = (duv2.y * edge1 - duv1.y * edge2) * inv_determinant;
+    dpdv = (duv1.x * edge2 - duv2.x * edge1) * inv_determinant;
+  }
+
+  // Sets uv_footprint from the width of a cone around r where it reaches p.
+  // The cone's cross section is spread over the surface at an angle, and
+  // then scaled by how much surface a unit of uv covers.
+  inline void set_footprint(const ray &r, const real cone_width) {
+    const real uv_area = glm::length(glm::cross(dpdu, dpdv));
+    if (cone_width <= 0.0 || uv_area <= 0.0) {
+      uv_footprint = 0.0;
+      return;
+    }
+    const real cos_theta =
+        std::abs(glm::dot(r.dir, geometric_normal)) / glm::length(r.dir);
+    uv_footprint =
+        cone_width / std::sqrt(uv_area * std::max(cos_theta, real(0.01)));
+  }
 
   inline void set_face_normal(const ray &r, const vec3 &outward_normal) {
     front_face = glm::dot(r.dir, outward_normal) < 0.0;
@@ -23,13 +134,41 @@ struct hit_record {
 
 class hittable {
 public:
-  // Return true if the specified ray hits the object between t_min and t_max,
-  // with output variable rec, and false otherwise
+  // Return true if the specified ray hits the object in (t_min, t_max], and
+  // false otherwise. Only t, the barycentrics and the path of rec are
+  // filled in, and only when there is a hit.
   virtual bool hit(const ray &r, const real t_min, const real t_max,
                    hit_record &rec) const = 0;
 
+  // Return true if the specified ray hits anything in (t_min, t_max]. Unlike
+  // hit, this may stop at the first hit found rather than the closest, and
+  // fills in no record, so it is the query to use for visibility tests.
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const {
+    hit_record rec;
+    return hit(r, t_min, t_max, rec);
+  }
+
+  // Fill in the point, normal, uv's and material of rec, given that path_idx
+  // is this object's entry in rec.path. Objects which change space forward
+  // the ray to the entry below theirs and transform the result back.
+  virtual void compute_surface_interaction(const ray &r, hit_record &rec,
+                                           const size_t path_idx) const {}
+
+  // Add the emitting primitives at or below this object to lights, placed in
+  // the world by model_matrix. outer_path holds the path entries that the
+  // objects above this one push onto a hit_record, outermost first.
+  virtual void
+  gather_lights(light_list &lights, const mat4 &model_matrix,
+                std::vector<hit_record::path_entry> &outer_path) const {}
+
   // Return true if the object has a bounding box across the entire region
   // [time0, time1], with output variable output_box, and false otherwise.
   virtual bool bounding_box(const real time0, const real time1,
                             aabb &output_box) const = 0;
 };
+
+inline void hit_record::compute_surface_interaction(const ray &r) {
+  path[path_length - 1].object->compute_surface_interaction(r, *this,
+                                                            path_length - 1);
+}
@@ -1,14 +1,10 @@
 
 #include "hittable_list.hpp"
 
-#include "material.hpp"
-#include "material_manager.hpp"
-#include "sphere.hpp"
-#include "texture.hpp"
+#include "light_list.hpp"
 
 bool hittable_list::hit(const ray &r, const real t_min, const real t_max,
                         hit_record &rec) const {
-  hit_record temp_rec;
   bool hit_anything = false;
   real closest_so_far = t_max;
   aabb bounding_box;
@@ -18,16 +14,28 @@ bool hittable_list::hit(const ray &r, const real t_min, const real t_max,
         !bounding_box.does_hit(r, t_min, t_max))
       continue;
 
-    if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+    if (object->hit(r, t_min, closest_so_far, rec)) {
       hit_anything = true;
-      closest_so_far = temp_rec.t;
-      rec = temp_rec;
+      closest_so_far = rec.t;
     }
   }
 
   return hit_anything;
 }
 
+bool hittable_list::occluded(const ray &r, const real t_min,
+                             const real t_max) const {
+  aabb bounding_box;
+  for (const auto &object : m_objects) {
+    if (object->bounding_box(r.time, r.time, bounding_box) &&
+        !bounding_box.does_hit(r, t_min, t_max))
+      continue;
+    if (object->occluded(r, t_min, t_max))
+      return true;
+  }
+  return false;
+}
+
 bool hittable_list::bounding_box(const real time0, const real time1,
                                  aabb &output_box) const {
   if (m_objects.empty())
@@ -44,9 +52,14 @@ bool hittable_list::bounding_box(const real time0, const real time1,
 }
 
 void hittable_list::add_background_map(const std::string_view &filename) {
-  const real radius = 1e5;
-  const auto skybox_image = std::make_shared<image_texture>(filename);
-  const auto skybox_texture =
-      material_manager::create<diffuse_light>(skybox_image);
-  this->add(std::make_shared<sphere>(point3(0.0), radius, skybox_texture));
+  m_environment = std::make_shared<environment_light>(filename);
+}
+
+void hittable_list::gather_lights(
+    light_list &lights, const mat4 &model_matrix,
+    std::vector<hit_record::path_entry> &outer_path) const {
+  if (m_environment)
+    lights.set_environment(m_environment);
+  for (const auto &object : m_objects)
+    object->gather_lights(lights, model_matrix, outer_path);
 }
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include "environment_light.hpp"
 #include "hittable.hpp"
 #include "util.hpp"
 
@@ -10,6 +11,8 @@
 
 struct hittable_list : public hittable {
   std::vector<std::shared_ptr<hittable>> m_objects;
+  // Lights the rays which miss every object, if set
+  std::shared_ptr<environment_light> m_environment;
 
   hittable_list() = default;
   hittable_list(const std::shared_ptr<hittable> &object) { add(object); }
@@ -28,6 +31,11 @@ struct hittable_list : public hittable {
 
   virtual bool hit(const ray &r, const real t_min, const real t_max,
                    hit_record &rec) const override;
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override;
+  virtual void
+  gather_lights(light_list &lights, const mat4 &model_matrix,
+                std::vector<hit_record::path_entry> &outer_path) const override;
   virtual bool bounding_box(const real time0, const real time1,
                             aabb &output_box) const override;
 };
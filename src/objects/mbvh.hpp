@@ -0,0 +1,372 @@
+#pragma once
+
+#include "bvh.hpp"
+#include "bvh_node.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "util.hpp"
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// A multi-branching BVH, collapsed from a binary bvh<> so that every node has
+// up to 'width' children. The child bounds of each node are stored as a
+// structure of arrays so one SIMD slab test covers all of them at once.
+template <size_t width = 4, bvh_split_strategy split_strategy = SAH>
+struct mbvh : public hittable {
+  static_assert(width == 4 || width == 8, "mbvh supports widths 4 and 8");
+
+  struct alignas(64) mbvh_node {
+    float min_x[width], min_y[width], min_z[width];
+    float max_x[width], max_y[width], max_z[width];
+    // child[i] is a node index, or the first primitive when count[i] has
+    // bvh_node::leaf_flag set, in which case the rest is the primitive count
+    uint32_t child[width];
+    uint32_t count[width];
+    // Bit i is set when slot i holds a child
+    uint32_t occupied = 0;
+
+    void set_child(const size_t slot, const aabb &box, const uint32_t idx,
+                   const uint32_t cnt) {
+      min_x[slot] = round_down_to_float(box.min.x);
+      min_y[slot] = round_down_to_float(box.min.y);
+      min_z[slot] = round_down_to_float(box.min.z);
+      max_x[slot] = round_up_to_float(box.max.x);
+      max_y[slot] = round_up_to_float(box.max.y);
+      max_z[slot] = round_up_to_float(box.max.z);
+      child[slot] = idx;
+      count[slot] = cnt;
+      occupied |= 1u << slot;
+    }
+  };
+
+  // A ray in the precision of the node bounds
+  struct simd_ray {
+    float orig[3];
+    float inv_dir[3];
+  };
+
+  std::vector<std::shared_ptr<hittable>> m_primitives;
+  std::vector<aabb> m_bounding_boxes;
+  std::vector<mbvh_node> m_nodes;
+  aabb m_bounding_box;
+  size_t m_max_depth = 0;
+
+  // Each level leaves at most width - 1 deferred children on the stack
+  static constexpr size_t max_stack_size = 512;
+
+public:
+  mbvh(const hittable_list &lst, const real time0, const real time1,
+       const size_t max_nodes_per_leaf = 4)
+      : mbvh(bvh<split_strategy>(lst, time0, time1, max_nodes_per_leaf)) {}
+  explicit mbvh(const bvh<split_strategy> &binary);
+
+  virtual ~mbvh() {}
+
+  virtual bool hit(const ray &r, const real t_min, const real t_max,
+                   hit_record &rec) const override;
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override;
+
+  virtual void gather_lights(
+      light_list &lights, const mat4 &model_matrix,
+      std::vector<hit_record::path_entry> &outer_path) const override {
+    for (const auto &primitive : m_primitives)
+      primitive->gather_lights(lights, model_matrix, outer_path);
+  }
+
+  virtual bool bounding_box(const real time0, const real time1,
+                            aabb &output_box) const override {
+    if (m_nodes.empty())
+      return false;
+    output_box = m_bounding_box;
+    return true;
+  }
+
+private:
+  uint32_t collapse(const bvh<split_strategy> &binary, const size_t entry_idx,
+                    const size_t depth);
+
+  // Returns a bitmask of the children of node hit between t_min and t_max,
+  // with their entry distances written to t_enter
+  static uint32_t hit_children(const mbvh_node &node, const simd_ray &r,
+                               const float t_min, const float t_max,
+                               float *t_enter);
+};
+
+// ============================= IMPLEMENTATION =============================
+
+template <size_t width, bvh_split_strategy strategy>
+mbvh<width, strategy>::mbvh(const bvh<strategy> &binary)
+    : m_primitives(binary.m_primitives),
+      m_bounding_boxes(binary.m_bounding_boxes) {
+  const auto start_ns = util::get_time_ns();
+  if (binary.m_entries.empty())
+    return;
+
+  m_bounding_box = binary.m_entries[0].bounding_box;
+  if (binary.m_entries[0].is_leaf) {
+    // A single leaf still needs a node to hang off of
+    const auto &entry = binary.m_entries[0];
+    m_nodes.emplace_back();
+    m_nodes[0].set_child(0, entry.bounding_box, entry.primitive_start,
+                         (entry.primitive_end - entry.primitive_start) |
+                             bvh_node::leaf_flag);
+  } else {
+    collapse(binary, 0, 0);
+  }
+
+  if ((width - 1) * m_max_depth + width > max_stack_size)
+    throw std::runtime_error("Could not build MBVH: tree is too deep");
+
+  const auto end_ns = util::get_time_ns();
+  const real total_seconds = (end_ns - start_ns) / 1e9;
+
+  std::cout << "Finished collapsing a BVH into a " << width << "-wide MBVH"
+            << std::endl;
+  std::cout << "  " << total_seconds << " seconds" << std::endl;
+  std::cout << "  " << m_primitives.size() << " primitives" << std::endl;
+  std::cout << "  " << m_nodes.size() << " nodes" << std::endl;
+  std::cout << "  " << m_max_depth << " max depth" << std::endl;
+}
+
+template <size_t width, bvh_split_strategy strategy>
+uint32_t mbvh<width, strategy>::collapse(const bvh<strategy> &binary,
+                                         const size_t entry_idx,
+                                         const size_t depth) {
+  m_max_depth = std::max(m_max_depth, depth);
+
+  // Greedily open up the interior child with the largest surface area until
+  // the node is full, since it is the one most likely to be hit
+  const auto &entries = binary.m_entries;
+  std::array<size_t, width> children;
+  size_t num_children = 2;
+  children[0] = entries[entry_idx].left_child;
+  children[1] = entries[entry_idx].left_child + 1;
+  while (num_children < width) {
+    size_t best_slot = width;
+    real best_area = -inf;
+    for (size_t slot = 0; slot < num_children; ++slot) {
+      const auto &child = entries[children[slot]];
+      const real area = child.bounding_box.surface_area();
+      if (!child.is_leaf && area > best_area) {
+        best_slot = slot;
+        best_area = area;
+      }
+    }
+    if (best_slot == width)
+      break;
+    const size_t opened = children[best_slot];
+    children[best_slot] = entries[opened].left_child;
+    children[num_children++] = entries[opened].left_child + 1;
+  }
+
+  const uint32_t node_idx = m_nodes.size();
+  m_nodes.emplace_back();
+  for (size_t slot = 0; slot < num_children; ++slot) {
+    const auto &child = entries[children[slot]];
+    if (child.is_leaf) {
+      const uint32_t num_primitives =
+          child.primitive_end - child.primitive_start;
+      m_nodes[node_idx].set_child(slot, child.bounding_box,
+                                  child.primitive_start,
+                                  num_primitives | bvh_node::leaf_flag);
+    } else {
+      // m_nodes may reallocate while building the subtree
+      const uint32_t child_idx = collapse(binary, children[slot], depth + 1);
+      m_nodes[node_idx].set_child(slot, child.bounding_box, child_idx, 0);
+    }
+  }
+  return node_idx;
+}
+
+template <size_t width, bvh_split_strategy strategy>
+inline uint32_t mbvh<width, strategy>::hit_children(const mbvh_node &node,
+                                                    const simd_ray &r,
+                                                    const float t_min,
+                                                    const float t_max,
+                                                    float *t_enter) {
+  uint32_t mask = 0;
+#if defined(__AVX__)
+  if constexpr (width == 8) {
+    __m256 near[3], far[3];
+    const float *mins[3] = {node.min_x, node.min_y, node.min_z};
+    const float *maxs[3] = {node.max_x, node.max_y, node.max_z};
+    for (int axis = 0; axis < 3; ++axis) {
+      const __m256 o = _mm256_set1_ps(r.orig[axis]);
+      const __m256 inv = _mm256_set1_ps(r.inv_dir[axis]);
+      const __m256 t0 =
+          _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(mins[axis]), o), inv);
+      const __m256 t1 =
+          _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(maxs[axis]), o), inv);
+      near[axis] = _mm256_min_ps(t0, t1);
+      far[axis] = _mm256_max_ps(t0, t1);
+    }
+    const __m256 left = _mm256_max_ps(
+        _mm256_max_ps(near[0], near[1]),
+        _mm256_max_ps(near[2], _mm256_set1_ps(t_min)));
+    const __m256 right =
+        _mm256_min_ps(_mm256_min_ps(far[0], far[1]),
+                      _mm256_min_ps(far[2], _mm256_set1_ps(t_max)));
+    _mm256_storeu_ps(t_enter, left);
+    mask = _mm256_movemask_ps(_mm256_cmp_ps(left, right, _CMP_LT_OQ));
+    return mask & node.occupied;
+  }
+#endif
+  const float *mins[3] = {node.min_x, node.min_y, node.min_z};
+  const float *maxs[3] = {node.max_x, node.max_y, node.max_z};
+#if defined(__SSE2__)
+  for (size_t lane = 0; lane < width; lane += 4) {
+    __m128 near[3], far[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      const __m128 o = _mm_set1_ps(r.orig[axis]);
+      const __m128 inv = _mm_set1_ps(r.inv_dir[axis]);
+      const __m128 t0 =
+          _mm_mul_ps(_mm_sub_ps(_mm_load_ps(mins[axis] + lane), o), inv);
+      const __m128 t1 =
+          _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxs[axis] + lane), o), inv);
+      near[axis] = _mm_min_ps(t0, t1);
+      far[axis] = _mm_max_ps(t0, t1);
+    }
+    const __m128 left =
+        _mm_max_ps(_mm_max_ps(near[0], near[1]),
+                   _mm_max_ps(near[2], _mm_set1_ps(t_min)));
+    const __m128 right = _mm_min_ps(_mm_min_ps(far[0], far[1]),
+                                    _mm_min_ps(far[2], _mm_set1_ps(t_max)));
+    _mm_storeu_ps(t_enter + lane, left);
+    mask |= _mm_movemask_ps(_mm_cmplt_ps(left, right)) << lane;
+  }
+#else
+  for (size_t lane = 0; lane < width; ++lane) {
+    float left = t_min, right = t_max;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float t0 = (mins[axis][lane] - r.orig[axis]) * r.inv_dir[axis];
+      const float t1 = (maxs[axis][lane] - r.orig[axis]) * r.inv_dir[axis];
+      left = std::max(left, std::min(t0, t1));
+      right = std::min(right, std::max(t0, t1));
+    }
+    t_enter[lane] = left;
+    mask |= static_cast<uint32_t>(left < right) << lane;
+  }
+#endif
+  return mask & node.occupied;
+}
+
+template <size_t width, bvh_split_strategy strategy>
+bool mbvh<width, strategy>::hit(const ray &r, const real t_min,
+                                const real t_max, hit_record &rec) const {
+  if (m_nodes.empty())
+    return false;
+
+  struct stack_entry {
+    uint32_t child, count;
+    float t_enter;
+  };
+  std::array<stack_entry, max_stack_size> stack;
+  size_t stack_size = 0;
+
+  simd_ray sr;
+  for (int axis = 0; axis < 3; ++axis) {
+    sr.orig[axis] = static_cast<float>(r.orig[axis]);
+    sr.inv_dir[axis] = static_cast<float>(1.0 / r.dir[axis]);
+  }
+
+  bool hit_anything = false;
+  real closest_so_far = t_max;
+  const float t_min_f = round_down_to_float(t_min);
+  stack[stack_size++] = {0, 0, t_min_f};
+  while (stack_size > 0) {
+    const stack_entry entry = stack[--stack_size];
+    if (entry.t_enter > closest_so_far)
+      continue;
+
+    if (entry.count & bvh_node::leaf_flag) {
+      const size_t prim_start = entry.child;
+      const size_t prim_end = prim_start + (entry.count & ~bvh_node::leaf_flag);
+      for (size_t prim_idx = prim_start; prim_idx < prim_end; ++prim_idx) {
+        const aabb &box = m_bounding_boxes[prim_idx];
+        if (!box.does_hit(r, t_min, closest_so_far))
+          continue;
+        if (m_primitives[prim_idx]->hit(r, t_min, closest_so_far, rec)) {
+          hit_anything = true;
+          closest_so_far = rec.t;
+        }
+      }
+      continue;
+    }
+
+    const mbvh_node &node = m_nodes[entry.child];
+    alignas(32) float t_enter[width];
+    uint32_t mask = hit_children(node, sr, t_min_f,
+                                 round_up_to_float(closest_so_far), t_enter);
+
+    // Sort the children which were hit by entry distance, then push them
+    // farthest first so the nearest one is visited next
+    std::array<size_t, width> order;
+    size_t num_hit = 0;
+    for (; mask != 0; mask &= mask - 1) {
+      const size_t slot = __builtin_ctz(mask);
+      size_t pos = num_hit++;
+      for (; pos > 0 && t_enter[order[pos - 1]] < t_enter[slot]; --pos)
+        order[pos] = order[pos - 1];
+      order[pos] = slot;
+    }
+    for (size_t idx = 0; idx < num_hit; ++idx) {
+      const size_t slot = order[idx];
+      stack[stack_size++] = {node.child[slot], node.count[slot], t_enter[slot]};
+    }
+  }
+  return hit_anything;
+}
+
+template <size_t width, bvh_split_strategy strategy>
+bool mbvh<width, strategy>::occluded(const ray &r, const real t_min,
+                                     const real t_max) const {
+  if (m_nodes.empty())
+    return false;
+
+  // Any hit will do, so children are pushed in slot order without sorting
+  struct stack_entry {
+    uint32_t child, count;
+  };
+  std::array<stack_entry, max_stack_size> stack;
+  size_t stack_size = 0;
+
+  simd_ray sr;
+  for (int axis = 0; axis < 3; ++axis) {
+    sr.orig[axis] = static_cast<float>(r.orig[axis]);
+    sr.inv_dir[axis] = static_cast<float>(1.0 / r.dir[axis]);
+  }
+
+  const float t_min_f = round_down_to_float(t_min);
+  const float t_max_f = round_up_to_float(t_max);
+  stack[stack_size++] = {0, 0};
+  while (stack_size > 0) {
+    const stack_entry entry = stack[--stack_size];
+    if (entry.count & bvh_node::leaf_flag) {
+      const size_t prim_start = entry.child;
+      const size_t prim_end = prim_start + (entry.count & ~bvh_node::leaf_flag);
+      for (size_t prim_idx = prim_start; prim_idx < prim_end; ++prim_idx) {
+        if (m_bounding_boxes[prim_idx].does_hit(r, t_min, t_max) &&
+            m_primitives[prim_idx]->occluded(r, t_min, t_max))
+          return true;
+      }
+      continue;
+    }
+
+    const mbvh_node &node = m_nodes[entry.child];
+    alignas(32) float t_enter[width];
+    for (uint32_t mask = hit_children(node, sr, t_min_f, t_max_f, t_enter);
+         mask != 0; mask &= mask - 1) {
+      const size_t slot = __builtin_ctz(mask);
+      stack[stack_size++] = {node.child[slot], node.count[slot]};
+    }
+  }
+  return false;
+}
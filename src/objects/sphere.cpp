@@ -1,34 +1,35 @@
 
 #include "sphere.hpp"
+#include "light_list.hpp"
 
 __attribute__((hot)) bool sphere::hit(const ray &r, const real t_min,
                                       const real t_max, hit_record &rec) const {
-  const vec3 oc = r.orig - m_centre;
-  const real a = glm::dot(r.dir, r.dir);
-  const real half_b = glm::dot(oc, r.dir);
-  const real c = glm::dot(oc, oc) - m_radius * m_radius;
-
-  const real discriminant = half_b * half_b - a * c;
-  if (discriminant < 0.0)
+  real root;
+  if (!intersect(m_centre, m_radius, r, t_min, t_max, root))
     return false;
-  const real sqrtd = std::sqrt(discriminant);
+  rec.set_hit(this, 0, root);
+  return true;
+}
 
-  // Find the nearest root that lies in the acceptable range.
-  real root = (-half_b - sqrtd) / a;
-  if (root < t_min || root > t_max) {
-    root = (-half_b + sqrtd) / a;
-    if (root < t_min || root > t_max)
-      return false;
-  }
+__attribute__((hot)) bool sphere::occluded(const ray &r, const real t_min,
+                                           const real t_max) const {
+  real root;
+  return intersect(m_centre, m_radius, r, t_min, t_max, root);
+}
 
-  rec.t = root;
-  rec.p = r.at(rec.t);
-  const vec3 outward_normal = (rec.p - m_centre) / m_radius;
+void sphere::compute_surface_interaction(const ray &r, hit_record &rec,
+                                         const size_t path_idx) const {
+  // Reprojecting the hit point onto the sphere keeps its error relative to
+  // the sphere's own coordinates rather than the length of the ray
+  const vec3 outward_normal = glm::normalize(r.at(rec.t) - m_centre);
+  rec.p = m_centre + m_radius * outward_normal;
+  rec.p_error = util::gamma(6) *
+                (glm::abs(m_radius * outward_normal) + glm::abs(m_centre));
+  rec.geometric_normal = outward_normal;
   rec.set_face_normal(r, outward_normal);
   get_sphere_uv(outward_normal, rec.u, rec.v);
+  get_sphere_uv_derivatives(outward_normal, m_radius, rec.dpdu, rec.dpdv);
   rec.mat_ptr = m_mat_ptr;
-
-  return true;
 }
 
 bool sphere::bounding_box(const real time0, const real time1,
@@ -36,3 +37,13 @@ bool sphere::bounding_box(const real time0, const real time1,
   output_box = aabb(m_centre - vec3(m_radius), m_centre + vec3(m_radius));
   return true;
 }
+
+void sphere::gather_lights(
+    light_list &lights, const mat4 &model_matrix,
+    std::vector<hit_record::path_entry> &outer_path) const {
+  if (!m_mat_ptr->is_emissive())
+    return;
+  lights.add(light_list::emitter::sphere(m_centre, m_centre, 0.0, 1.0,
+                                         m_radius, m_mat_ptr),
+             this, 0, model_matrix, outer_path);
+}
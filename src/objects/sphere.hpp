@@ -16,13 +16,65 @@ struct sphere : public hittable {
 
   virtual bool hit(const ray &r, const real t_min, const real t_max,
                    hit_record &rec) const override;
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override;
+  virtual void
+  compute_surface_interaction(const ray &r, hit_record &rec,
+                              const size_t path_idx) const override;
+  virtual void
+  gather_lights(light_list &lights, const mat4 &model_matrix,
+                std::vector<hit_record::path_entry> &outer_path) const override;
   virtual bool bounding_box(const real time0, const real time1,
                             aabb &output_box) const override;
 
+  // Return true if r hits the sphere with the given centre and radius in
+  // (t_min, t_max], with output variable t set to the nearest such hit
+  static inline bool intersect(const point3 &centre, const real radius,
+                               const ray &r, const real t_min,
+                               const real t_max, real &t) {
+    const vec3 oc = r.orig - centre;
+    const real a = glm::dot(r.dir, r.dir);
+    const real half_b = glm::dot(oc, r.dir);
+    const real c = glm::dot(oc, oc) - radius * radius;
+
+    const real discriminant = half_b * half_b - a * c;
+    if (discriminant < 0.0)
+      return false;
+    const real sqrtd = std::sqrt(discriminant);
+
+    // Find the nearest root that lies in the acceptable range. Computing the
+    // smaller-magnitude root as c / q avoids the cancellation in -b + sqrt(d).
+    const real q = -(half_b + std::copysign(sqrtd, half_b));
+    const real root0 = q / a, root1 = c / q;
+    t = std::min(root0, root1);
+    if (t <= t_min || t > t_max) {
+      t = std::max(root0, root1);
+      if (t <= t_min || t > t_max)
+        return false;
+    }
+    return true;
+  }
+
   static constexpr void get_sphere_uv(const point3 &p, real &u, real &v) {
     const real theta = acos(-p.y);
     const real phi = atan2(-p.z, p.x) + pi;
     u = phi / (2.0 * pi);
     v = theta / pi;
   }
+
+  // How a point on a sphere of the given radius moves with the u and v of
+  // get_sphere_uv, at the unit outward normal n. Zero at the poles, where u
+  // is undefined.
+  static inline void get_sphere_uv_derivatives(const vec3 &n,
+                                               const real radius, vec3 &dpdu,
+                                               vec3 &dpdv) {
+    const real sin_theta = std::sqrt(n.x * n.x + n.z * n.z);
+    if (sin_theta == 0.0) {
+      dpdu = dpdv = vec3(0.0);
+      return;
+    }
+    dpdu = real(2.0 * pi) * radius * vec3(n.z, 0.0, -n.x);
+    dpdv = real(pi) * radius *
+           vec3(-n.x * n.y / sin_theta, sin_theta, -n.y * n.z / sin_theta);
+  }
 };
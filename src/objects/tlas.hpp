@@ -0,0 +1,303 @@
+#pragma once
+
+#include "bvh.hpp"
+#include "bvh_node.hpp"
+#include "hittable.hpp"
+#include "light_list.hpp"
+#include "util.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// A two-level acceleration structure: a top-level BVH over instances, each of
+// which places a shared bottom-level structure (BLAS) in the world through an
+// affine transform. The top level is traversed in world space, and each BLAS
+// is entered in its own object space through a direct, non-virtual call.
+//
+// blas_type must be a hittable which exposes its flattened nodes as m_nodes.
+template <class blas_type> struct tlas : public hittable {
+  struct instance {
+    // The top three rows of the model matrix and of its inverse
+    vec4 model_rows[3];
+    vec4 inv_rows[3];
+    uint32_t blas_idx;
+
+    // Applies the inverse transform to r, preserving its parametrization
+    constexpr inline ray to_object_space(const ray &r) const {
+      const vec4 orig(r.orig, 1.0), dir(r.dir, 0.0);
+      return ray(point3(glm::dot(inv_rows[0], orig),
+                        glm::dot(inv_rows[1], orig),
+                        glm::dot(inv_rows[2], orig)),
+                 vec3(glm::dot(inv_rows[0], dir), glm::dot(inv_rows[1], dir),
+                      glm::dot(inv_rows[2], dir)),
+                 r.time);
+    }
+
+    constexpr inline point3 point_to_world_space(const point3 &p) const {
+      const vec4 point(p, 1.0);
+      return point3(glm::dot(model_rows[0], point),
+                    glm::dot(model_rows[1], point),
+                    glm::dot(model_rows[2], point));
+    }
+
+    constexpr inline vec3 vector_to_world_space(const vec3 &v) const {
+      return vec3(glm::dot(vec3(model_rows[0]), v),
+                  glm::dot(vec3(model_rows[1]), v),
+                  glm::dot(vec3(model_rows[2]), v));
+    }
+
+    inline mat4 model_matrix() const {
+      mat4 result(1.0);
+      for (int row = 0; row < 3; ++row)
+        for (int col = 0; col < 4; ++col)
+          result[col][row] = model_rows[row][col];
+      return result;
+    }
+
+    // Normals transform by the inverse transpose of the model matrix
+    constexpr inline vec3 normal_to_world_space(const vec3 &normal) const {
+      return vec3(inv_rows[0]) * normal.x + vec3(inv_rows[1]) * normal.y +
+             vec3(inv_rows[2]) * normal.z;
+    }
+  };
+
+  std::vector<std::shared_ptr<blas_type>> m_blases;
+  std::vector<instance> m_instances;
+  std::vector<aabb> m_instance_boxes;
+  std::vector<bvh_node> m_nodes;
+  aabb m_bounding_box;
+  size_t m_max_depth = 0;
+
+  static constexpr size_t max_stack_depth = 64;
+  static constexpr size_t max_instances_per_leaf = 2;
+  // How many of the top nodes of a BLAS are transformed to bound an instance
+  static constexpr size_t bounding_nodes_per_instance = 32;
+
+public:
+  tlas() = default;
+  virtual ~tlas() {}
+
+  // Instances must all be added before calling build()
+  void add_instance(const std::shared_ptr<blas_type> &blas,
+                    const mat4 &model_matrix);
+  void build();
+
+  virtual bool hit(const ray &r, const real t_min, const real t_max,
+                   hit_record &rec) const override;
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override;
+  virtual void
+  compute_surface_interaction(const ray &r, hit_record &rec,
+                              const size_t path_idx) const override;
+  virtual void
+  gather_lights(light_list &lights, const mat4 &model_matrix,
+                std::vector<hit_record::path_entry> &outer_path) const override;
+
+  virtual bool bounding_box(const real time0, const real time1,
+                            aabb &output_box) const override {
+    if (m_nodes.empty())
+      return false;
+    output_box = m_bounding_box;
+    return true;
+  }
+
+private:
+  // Bounds the BLAS transformed by model_matrix. Transforming the boxes of a
+  // few of its top nodes gives a much tighter fit than transforming its root.
+  static aabb transformed_bounds(const blas_type &blas,
+                                 const mat4 &model_matrix);
+};
+
+// ============================= IMPLEMENTATION =============================
+
+template <class blas_type>
+void tlas<blas_type>::add_instance(const std::shared_ptr<blas_type> &blas,
+                                   const mat4 &model_matrix) {
+  // Instances of the same BLAS share a single copy of it
+  uint32_t blas_idx = 0;
+  while (blas_idx < m_blases.size() && m_blases[blas_idx] != blas)
+    blas_idx++;
+  if (blas_idx == m_blases.size())
+    m_blases.push_back(blas);
+
+  const mat4 inv_matrix = glm::inverse(model_matrix);
+  instance inst;
+  for (int row = 0; row < 3; ++row) {
+    inst.model_rows[row] =
+        vec4(model_matrix[0][row], model_matrix[1][row], model_matrix[2][row],
+             model_matrix[3][row]);
+    inst.inv_rows[row] = vec4(inv_matrix[0][row], inv_matrix[1][row],
+                              inv_matrix[2][row], inv_matrix[3][row]);
+  }
+  inst.blas_idx = blas_idx;
+  m_instances.push_back(inst);
+  m_instance_boxes.push_back(transformed_bounds(*blas, model_matrix));
+}
+
+template <class blas_type>
+aabb tlas<blas_type>::transformed_bounds(const blas_type &blas,
+                                         const mat4 &model_matrix) {
+  const std::vector<bvh_node> &nodes = blas.m_nodes;
+  if (nodes.empty())
+    return aabb();
+
+  // Open up the tree one level at a time while the frontier stays small
+  std::vector<uint32_t> frontier = {0}, next_frontier;
+  while (true) {
+    next_frontier.clear();
+    for (const uint32_t node_idx : frontier) {
+      const bvh_node &node = nodes[node_idx];
+      if (node.is_leaf()) {
+        next_frontier.push_back(node_idx);
+      } else {
+        next_frontier.push_back(node.left_child());
+        next_frontier.push_back(node.right_child());
+      }
+    }
+    if (next_frontier.size() == frontier.size() ||
+        next_frontier.size() > bounding_nodes_per_instance)
+      break;
+    std::swap(frontier, next_frontier);
+  }
+
+  aabb result;
+  for (const uint32_t node_idx : frontier)
+    result.merge(nodes[node_idx].bounding_box().apply(model_matrix));
+  return result;
+}
+
+template <class blas_type> void tlas<blas_type>::build() {
+  using builder = bvh<BinnedSAH>;
+  const auto start_ns = util::get_time_ns();
+
+  std::vector<builder::bvh_build_data> data(m_instances.size());
+  m_bounding_box = aabb();
+  for (size_t i = 0; i < m_instances.size(); ++i) {
+    data[i] = {i, m_instance_boxes[i], m_instance_boxes[i].centroid()};
+    m_bounding_box.merge(m_instance_boxes[i]);
+  }
+
+  std::atomic<long long> build_ns = 0;
+  const auto entries = builder::build(data, max_instances_per_leaf, build_ns);
+
+  // Leaves refer to ranges of data, so put the instances in the same order
+  std::vector<instance> ordered_instances(m_instances.size());
+  std::vector<aabb> ordered_boxes(m_instances.size());
+  for (size_t i = 0; i < data.size(); ++i) {
+    ordered_instances[i] = m_instances[data[i].primitive_index];
+    ordered_boxes[i] = m_instance_boxes[data[i].primitive_index];
+  }
+  m_instances = std::move(ordered_instances);
+  m_instance_boxes = std::move(ordered_boxes);
+
+  m_nodes = builder::flatten(entries, m_instances.size());
+  m_max_depth = builder::max_depth(entries);
+  if (m_max_depth >= max_stack_depth)
+    throw std::runtime_error("Could not build TLAS: tree is too deep");
+
+  const auto end_ns = util::get_time_ns();
+  const real total_seconds = (end_ns - start_ns) / 1e9;
+
+  std::cout << "Finished constructing a TLAS on " << m_instances.size()
+            << " instances of " << m_blases.size() << " BLASes" << std::endl;
+  std::cout << "  " << total_seconds << " seconds" << std::endl;
+  std::cout << "  " << m_nodes.size() << " nodes" << std::endl;
+  std::cout << "  " << m_max_depth << " max depth" << std::endl;
+}
+
+template <class blas_type>
+bool tlas<blas_type>::hit(const ray &r, const real t_min, const real t_max,
+                          hit_record &rec) const {
+  size_t closest_idx = 0;
+  const bool hit_anything = traverse_nodes<max_stack_depth>(
+      m_nodes, r, t_min, t_max,
+      [&](const uint32_t inst_start, const uint32_t inst_end,
+          real &closest_so_far) {
+        bool hit_leaf = false;
+        for (size_t inst_idx = inst_start; inst_idx < inst_end; ++inst_idx) {
+          if (!m_instance_boxes[inst_idx].does_hit(r, t_min, closest_so_far))
+            continue;
+          const instance &inst = m_instances[inst_idx];
+          const ray object_ray = inst.to_object_space(r);
+          const blas_type &blas = *m_blases[inst.blas_idx];
+          if (blas.blas_type::hit(object_ray, t_min, closest_so_far, rec)) {
+            hit_leaf = true;
+            closest_so_far = rec.t;
+            closest_idx = inst_idx;
+          }
+        }
+        return hit_leaf;
+      });
+  if (!hit_anything)
+    return false;
+  rec.push_path(this, closest_idx);
+  return true;
+}
+
+template <class blas_type>
+bool tlas<blas_type>::occluded(const ray &r, const real t_min,
+                               const real t_max) const {
+  return traverse_nodes<max_stack_depth, true>(
+      m_nodes, r, t_min, t_max,
+      [&](const uint32_t inst_start, const uint32_t inst_end,
+          real &closest_so_far) {
+        for (size_t inst_idx = inst_start; inst_idx < inst_end; ++inst_idx) {
+          if (!m_instance_boxes[inst_idx].does_hit(r, t_min, t_max))
+            continue;
+          const instance &inst = m_instances[inst_idx];
+          const blas_type &blas = *m_blases[inst.blas_idx];
+          if (blas.blas_type::occluded(inst.to_object_space(r), t_min, t_max))
+            return true;
+        }
+        return false;
+      });
+}
+
+template <class blas_type>
+void tlas<blas_type>::compute_surface_interaction(const ray &r,
+                                                  hit_record &rec,
+                                                  const size_t path_idx) const {
+  const instance &inst = m_instances[rec.path[path_idx].id];
+  const blas_type &blas = *m_blases[inst.blas_idx];
+  blas.blas_type::compute_surface_interaction(inst.to_object_space(r), rec,
+                                              path_idx - 1);
+
+  // The transform keeps the sign of dot(dir, normal), so front_face is
+  // already correct
+  rec.p_error =
+      util::transformed_point_error(inst.model_matrix(), rec.p, rec.p_error);
+  rec.p = inst.point_to_world_space(rec.p);
+  rec.geometric_normal =
+      glm::normalize(inst.normal_to_world_space(rec.geometric_normal));
+  rec.normal = glm::normalize(inst.normal_to_world_space(rec.normal));
+  rec.dpdu = inst.vector_to_world_space(rec.dpdu);
+  rec.dpdv = inst.vector_to_world_space(rec.dpdv);
+}
+
+template <class blas_type>
+void tlas<blas_type>::gather_lights(
+    light_list &lights, const mat4 &model_matrix,
+    std::vector<hit_record::path_entry> &outer_path) const {
+  // Visit each BLAS's primitives once, in its own space, so that building the
+  // light list costs the number of emitters per instance rather than the
+  // number of primitives
+  std::vector<light_list> blas_lights(m_blases.size());
+  std::vector<hit_record::path_entry> blas_path;
+  for (size_t blas_idx = 0; blas_idx < m_blases.size(); ++blas_idx)
+    m_blases[blas_idx]->gather_lights(blas_lights[blas_idx], mat4(1.0),
+                                      blas_path);
+
+  for (size_t inst_idx = 0; inst_idx < m_instances.size(); ++inst_idx) {
+    const instance &inst = m_instances[inst_idx];
+    const light_list &object_lights = blas_lights[inst.blas_idx];
+    if (object_lights.m_emitters.empty())
+      continue;
+    outer_path.push_back({this, static_cast<uint32_t>(inst_idx)});
+    lights.add_instance(object_lights, model_matrix * inst.model_matrix(),
+                        outer_path);
+    outer_path.pop_back();
+  }
+}
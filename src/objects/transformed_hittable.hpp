@@ -21,23 +21,54 @@ public:
         m_inv_trans_matrix(glm::transpose(m_inv_matrix)) {}
   virtual ~transformed_hittable() {}
 
-  virtual bool hit(const ray &r, const real t_min, const real t_max,
-                   hit_record &rec) const override {
-    // 1. Transform ray with the inverse model matrix
+  // Transforms r with the inverse model matrix, keeping its parametrization
+  inline ray to_object_space(const ray &r) const {
     const vec3 new_origin = m_inv_matrix * vec4(r.orig, 1.0);
     const vec3 new_direction = m_inv_matrix * vec4(r.dir, 0.0);
-    const ray new_ray(new_origin, new_direction, r.time);
+    return ray(new_origin, new_direction, r.time);
+  }
 
-    // 2. Hit the instance with that transformed_ray
-    // 3. If missed, return false
-    if (!m_instance->hit(new_ray, t_min, t_max, rec))
+  virtual bool hit(const ray &r, const real t_min, const real t_max,
+                   hit_record &rec) const override {
+    if (!m_instance->hit(to_object_space(r), t_min, t_max, rec))
       return false;
+    rec.push_path(this, 0);
+    return true;
+  }
+
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override {
+    return m_instance->occluded(to_object_space(r), t_min, t_max);
+  }
 
-    // 4. Transform everything in the hit_record accordingly and return true
+  virtual void
+  compute_surface_interaction(const ray &r, hit_record &rec,
+                              const size_t path_idx) const override {
+    // 1. Fill in the record in object space
+    const hittable *instance = rec.path[path_idx - 1].object;
+    instance->compute_surface_interaction(to_object_space(r), rec,
+                                          path_idx - 1);
+
+    // 2. Transform it back to world space. The transform keeps the sign of
+    // dot(dir, normal), so front_face is unchanged.
+    rec.p_error =
+        util::transformed_point_error(m_model_matrix, rec.p, rec.p_error);
     rec.p = m_model_matrix * vec4(rec.p, 1.0);
-    rec.set_face_normal(r, m_inv_trans_matrix * vec4(rec.normal, 0.0));
+    rec.geometric_normal = glm::normalize(
+        vec3(m_inv_trans_matrix * vec4(rec.geometric_normal, 0.0)));
+    rec.normal =
+        glm::normalize(vec3(m_inv_trans_matrix * vec4(rec.normal, 0.0)));
+    rec.dpdu = m_model_matrix * vec4(rec.dpdu, 0.0);
+    rec.dpdv = m_model_matrix * vec4(rec.dpdv, 0.0);
+  }
 
-    return true;
+  virtual void gather_lights(
+      light_list &lights, const mat4 &model_matrix,
+      std::vector<hit_record::path_entry> &outer_path) const override {
+    outer_path.push_back({this, 0});
+    m_instance->gather_lights(lights, model_matrix * m_model_matrix,
+                              outer_path);
+    outer_path.pop_back();
   }
 
   virtual bool bounding_box(const real time0, const real time1,
@@ -1,50 +1,45 @@
 
 #include "triangle.hpp"
+#include "light_list.hpp"
 
 __attribute__((hot)) bool triangle::hit(const ray &r, const real t_min,
                                         const real t_max,
                                         hit_record &rec) const {
-  const vec3 edge1 = m_p1.position - m_p0.position;
-  const vec3 edge2 = m_p2.position - m_p0.position;
-  const vec3 rop0 = r.orig - m_p0.position;
-  const vec3 n = glm::cross(edge1, edge2);
-  const real a = glm::dot(r.dir, n);
-  // if (a > -eps && a < eps)
-  //   return false;
-  const real d = 1.0 / a;
-  const real t = -d * glm::dot(n, rop0);
-  if (t < t_min || t > t_max)
+  real t, u, v;
+  if (!intersect(r, t_min, t_max, t, u, v))
     return false;
+  rec.set_hit(this, 0, t, u, v);
+  return true;
+}
 
-  const vec3 q = glm::cross(rop0, r.dir);
-  const real u = -d * glm::dot(q, edge2);
-  if (u < 0.0 || u > 1.0)
-    return false;
-  const real v = d * glm::dot(q, edge1);
-  if (v < 0.0 || u + v > 1.0)
-    return false;
+__attribute__((hot)) bool triangle::occluded(const ray &r, const real t_min,
+                                             const real t_max) const {
+  real t, u, v;
+  return intersect(r, t_min, t_max, t, u, v);
+}
 
-  rec.t = t;
-  rec.p = r.at(t);
+void triangle::compute_surface_interaction(const ray &r, hit_record &rec,
+                                           const size_t path_idx) const {
+  const real u = rec.b1, v = rec.b2;
+  // Interpolating the hit point keeps its error relative to the vertices
+  // rather than the length of the ray
+  rec.p = m_p0 + u * m_edge1 + v * m_edge2;
+  rec.p_error =
+      util::gamma(7) * (real(3.0) * glm::abs(m_p0) + glm::abs(m_edge1) +
+                        glm::abs(m_edge2));
+  rec.geometric_normal = glm::normalize(m_normal);
 
   // Compute uv's
-  const vec3 uv0 = m_p0.uv.value_or(vec3(0.0, 0.0, 0.0));
-  const vec3 uv1 = m_p1.uv.value_or(vec3(1.0, 0.0, 0.0));
-  const vec3 uv2 = m_p2.uv.value_or(vec3(0.0, 1.0, 0.0));
-  const vec3 uv = uv0 + u * (uv1 - uv0) + v * (uv2 - uv0);
-
+  const vec3 uv = m_uv0 + u * (m_uv1 - m_uv0) + v * (m_uv2 - m_uv0);
   rec.u = uv[0];
   rec.v = uv[1];
+  rec.set_uv_derivatives(m_edge1, m_edge2, m_uv1 - m_uv0, m_uv2 - m_uv0);
 
-  const vec3 normal0 = m_p0.normal.value_or(n);
-  const vec3 normal1 = m_p1.normal.value_or(n);
-  const vec3 normal2 = m_p2.normal.value_or(n);
   const vec3 normal =
-      normal0 + u * (normal1 - normal0) + v * (normal2 - normal0);
+      m_normal0 + u * (m_normal1 - m_normal0) + v * (m_normal2 - m_normal0);
   rec.set_face_normal(r, normal);
 
   rec.mat_ptr = m_mat_ptr;
-  return true;
 }
 
 bool triangle::bounding_box(const real time0, const real time1,
@@ -52,3 +47,13 @@ bool triangle::bounding_box(const real time0, const real time1,
   output_box = m_bounding_box;
   return true;
 }
+
+void triangle::gather_lights(
+    light_list &lights, const mat4 &model_matrix,
+    std::vector<hit_record::path_entry> &outer_path) const {
+  if (!m_mat_ptr->is_emissive())
+    return;
+  lights.add(light_list::emitter::triangle(m_p0, m_edge1, m_edge2, m_uv0,
+                                           m_uv1, m_uv2, m_mat_ptr),
+             this, 0, model_matrix, outer_path);
+}
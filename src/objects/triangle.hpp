@@ -20,13 +20,26 @@ struct vertex {
 };
 
 struct triangle : public hittable {
-  const vertex m_p0, m_p1, m_p2;
+  // Intersection data, precomputed from the vertex positions
+  point3 m_p0;
+  vec3 m_edge1, m_edge2, m_normal;
+  // Vertex attributes, with defaults filled in for missing ones
+  vec3 m_uv0, m_uv1, m_uv2;
+  vec3 m_normal0, m_normal1, m_normal2;
   material *m_mat_ptr;
   aabb m_bounding_box;
 
   constexpr triangle(const vertex &p0, const vertex &p1, const vertex &p2,
                      material *mat)
-      : m_p0(p0), m_p1(p1), m_p2(p2), m_mat_ptr(mat) {
+      : m_p0(p0.position), m_edge1(p1.position - p0.position),
+        m_edge2(p2.position - p0.position),
+        m_normal(glm::cross(m_edge1, m_edge2)),
+        m_uv0(p0.uv.value_or(vec3(0.0, 0.0, 0.0))),
+        m_uv1(p1.uv.value_or(vec3(1.0, 0.0, 0.0))),
+        m_uv2(p2.uv.value_or(vec3(0.0, 1.0, 0.0))),
+        m_normal0(p0.normal.value_or(m_normal)),
+        m_normal1(p1.normal.value_or(m_normal)),
+        m_normal2(p2.normal.value_or(m_normal)), m_mat_ptr(mat) {
     m_bounding_box.merge(p0.position);
     m_bounding_box.merge(p1.position);
     m_bounding_box.merge(p2.position);
@@ -37,6 +50,38 @@ struct triangle : public hittable {
 
   virtual bool hit(const ray &r, const real t_min, const real t_max,
                    hit_record &rec) const override;
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override;
+  virtual void
+  compute_surface_interaction(const ray &r, hit_record &rec,
+                              const size_t path_idx) const override;
+  virtual void
+  gather_lights(light_list &lights, const mat4 &model_matrix,
+                std::vector<hit_record::path_entry> &outer_path) const override;
   virtual bool bounding_box(const real time0, const real time1,
                             aabb &output_box) const override;
+
+private:
+  // Return true if r hits the triangle in (t_min, t_max], with output
+  // variables t and the barycentrics u, v set for the hit
+  inline bool intersect(const ray &r, const real t_min, const real t_max,
+                        real &t, real &u, real &v) const {
+    const vec3 rop0 = r.orig - m_p0;
+    const real a = glm::dot(r.dir, m_normal);
+    // if (a > -eps && a < eps)
+    //   return false;
+    const real d = 1.0 / a;
+    t = -d * glm::dot(m_normal, rop0);
+    if (t <= t_min || t > t_max)
+      return false;
+
+    const vec3 q = glm::cross(rop0, r.dir);
+    u = -d * glm::dot(q, m_edge2);
+    if (u < 0.0 || u > 1.0)
+      return false;
+    v = d * glm::dot(q, m_edge1);
+    if (v < 0.0 || u + v > 1.0)
+      return false;
+    return true;
+  }
 };
@@ -0,0 +1,205 @@
+
+#include "triangle_mesh.hpp"
+#include "bvh.hpp"
+#include "light_list.hpp"
+
+#include <atomic>
+#include <stdexcept>
+
+triangle_mesh::triangle_mesh(std::vector<point3> &&positions,
+                             std::vector<vec3> &&normals,
+                             std::vector<vec3> &&uvs,
+                             std::vector<material *> &&materials,
+                             std::vector<mesh_triangle> &&triangles)
+    : m_positions(std::move(positions)), m_normals(std::move(normals)),
+      m_uvs(std::move(uvs)), m_materials(std::move(materials)),
+      m_triangles(std::move(triangles)) {
+  build();
+}
+
+void triangle_mesh::build() {
+  using builder = bvh<BinnedSAH>;
+  const auto start_ns = util::get_time_ns();
+
+  std::vector<builder::bvh_build_data> data(m_triangles.size());
+  for (size_t i = 0; i < m_triangles.size(); ++i) {
+    const mesh_triangle &tri = m_triangles[i];
+    aabb bounding_box;
+    for (int j = 0; j < 3; ++j)
+      bounding_box.merge(m_positions[tri.position_idx[j]]);
+    // Axis-aligned triangles would otherwise have flat boxes
+    bounding_box.expand(eps);
+    data[i] = {i, bounding_box, bounding_box.centroid()};
+  }
+
+  std::atomic<long long> build_ns = 0;
+  const auto entries = builder::build(data, max_triangles_per_leaf, build_ns);
+
+  // Leaves refer to ranges of data, so put the triangles in the same order
+  std::vector<mesh_triangle> ordered_triangles(m_triangles.size());
+  for (size_t i = 0; i < data.size(); ++i)
+    ordered_triangles[i] = m_triangles[data[i].primitive_index];
+  m_triangles = std::move(ordered_triangles);
+
+  m_intersection_data.resize(m_triangles.size());
+  for (size_t i = 0; i < m_triangles.size(); ++i) {
+    const mesh_triangle &tri = m_triangles[i];
+    const point3 &p0 = m_positions[tri.position_idx[0]];
+    const vec3 edge1 = m_positions[tri.position_idx[1]] - p0;
+    const vec3 edge2 = m_positions[tri.position_idx[2]] - p0;
+    m_intersection_data[i] = {edge1, edge2};
+  }
+
+  m_nodes = builder::flatten(entries, m_triangles.size());
+  m_max_depth = builder::max_depth(entries);
+  if (m_max_depth >= max_stack_depth)
+    throw std::runtime_error("Could not build mesh BVH: tree is too deep");
+
+  const auto end_ns = util::get_time_ns();
+  const real total_seconds = (end_ns - start_ns) / 1e9;
+
+  std::cout << "Finished constructing a mesh BVH on " << m_triangles.size()
+            << " triangles" << std::endl;
+  std::cout << "  " << total_seconds << " seconds" << std::endl;
+  std::cout << "  " << m_nodes.size() << " nodes" << std::endl;
+  std::cout << "  " << m_max_depth << " max depth" << std::endl;
+}
+
+__attribute__((hot)) bool triangle_mesh::hit(const ray &r, const real t_min,
+                                             const real t_max,
+                                             hit_record &rec) const {
+  size_t closest_idx = 0;
+  real closest_t = t_max, closest_u = 0.0, closest_v = 0.0;
+  const bool hit_anything = traverse_nodes<max_stack_depth>(
+      m_nodes, r, t_min, t_max,
+      [&](const uint32_t tri_start, const uint32_t tri_end,
+          real &closest_so_far) {
+        bool hit_leaf = false;
+        for (size_t tri_idx = tri_start; tri_idx < tri_end; ++tri_idx) {
+          const intersection_data &tri = m_intersection_data[tri_idx];
+          const point3 &p0 = m_positions[m_triangles[tri_idx].position_idx[0]];
+          const vec3 normal = glm::cross(tri.edge1, tri.edge2);
+          const vec3 rop0 = r.orig - p0;
+          const real d = 1.0 / glm::dot(r.dir, normal);
+          const real t = -d * glm::dot(normal, rop0);
+          if (t <= t_min || t > closest_so_far)
+            continue;
+
+          const vec3 q = glm::cross(rop0, r.dir);
+          const real u = -d * glm::dot(q, tri.edge2);
+          if (u < 0.0 || u > 1.0)
+            continue;
+          const real v = d * glm::dot(q, tri.edge1);
+          if (v < 0.0 || u + v > 1.0)
+            continue;
+
+          hit_leaf = true;
+          closest_so_far = t;
+          closest_idx = tri_idx;
+          closest_t = t;
+          closest_u = u;
+          closest_v = v;
+        }
+        return hit_leaf;
+      });
+  if (!hit_anything)
+    return false;
+
+  rec.set_hit(this, closest_idx, closest_t, closest_u, closest_v);
+  return true;
+}
+
+__attribute__((hot)) bool triangle_mesh::occluded(const ray &r,
+                                                  const real t_min,
+                                                  const real t_max) const {
+  return traverse_nodes<max_stack_depth, true>(
+      m_nodes, r, t_min, t_max,
+      [&](const uint32_t tri_start, const uint32_t tri_end,
+          real &closest_so_far) {
+        for (size_t tri_idx = tri_start; tri_idx < tri_end; ++tri_idx) {
+          const intersection_data &tri = m_intersection_data[tri_idx];
+          const point3 &p0 = m_positions[m_triangles[tri_idx].position_idx[0]];
+          const vec3 normal = glm::cross(tri.edge1, tri.edge2);
+          const vec3 rop0 = r.orig - p0;
+          const real d = 1.0 / glm::dot(r.dir, normal);
+          const real t = -d * glm::dot(normal, rop0);
+          if (t <= t_min || t > t_max)
+            continue;
+
+          const vec3 q = glm::cross(rop0, r.dir);
+          const real u = -d * glm::dot(q, tri.edge2);
+          if (u < 0.0 || u > 1.0)
+            continue;
+          const real v = d * glm::dot(q, tri.edge1);
+          if (v < 0.0 || u + v > 1.0)
+            continue;
+          return true;
+        }
+        return false;
+      });
+}
+
+void triangle_mesh::compute_surface_interaction(const ray &r, hit_record &rec,
+                                                const size_t path_idx) const {
+  const uint32_t tri_idx = rec.path[path_idx].id;
+  const mesh_triangle &tri = m_triangles[tri_idx];
+  const real u = rec.b1, v = rec.b2;
+
+  const intersection_data &data = m_intersection_data[tri_idx];
+  const point3 &p0 = m_positions[tri.position_idx[0]];
+  const vec3 normal = glm::cross(data.edge1, data.edge2);
+  rec.p = p0 + u * data.edge1 + v * data.edge2;
+  rec.p_error =
+      util::gamma(7) * (real(3.0) * glm::abs(p0) + glm::abs(data.edge1) +
+                        glm::abs(data.edge2));
+  rec.geometric_normal = glm::normalize(normal);
+
+  // Triangles without uv's map their corners to (0, 0), (1, 0) and (0, 1)
+  if (tri.uv_idx[0] == no_index) {
+    rec.u = u;
+    rec.v = v;
+    rec.set_uv_derivatives(data.edge1, data.edge2, vec3(1.0, 0.0, 0.0),
+                           vec3(0.0, 1.0, 0.0));
+  } else {
+    const vec3 &uv0 = m_uvs[tri.uv_idx[0]];
+    const vec3 duv1 = m_uvs[tri.uv_idx[1]] - uv0,
+               duv2 = m_uvs[tri.uv_idx[2]] - uv0;
+    const vec3 uv = uv0 + u * duv1 + v * duv2;
+    rec.u = uv[0];
+    rec.v = uv[1];
+    rec.set_uv_derivatives(data.edge1, data.edge2, duv1, duv2);
+  }
+
+  if (tri.normal_idx[0] == no_index) {
+    rec.set_face_normal(r, normal);
+  } else {
+    const vec3 &normal0 = m_normals[tri.normal_idx[0]];
+    const vec3 normal = normal0 +
+                        u * (m_normals[tri.normal_idx[1]] - normal0) +
+                        v * (m_normals[tri.normal_idx[2]] - normal0);
+    rec.set_face_normal(r, normal);
+  }
+
+  rec.mat_ptr = m_materials[tri.material_idx];
+}
+
+void triangle_mesh::gather_lights(
+    light_list &lights, const mat4 &model_matrix,
+    std::vector<hit_record::path_entry> &outer_path) const {
+  for (size_t tri_idx = 0; tri_idx < m_triangles.size(); ++tri_idx) {
+    const mesh_triangle &tri = m_triangles[tri_idx];
+    material *mat = m_materials[tri.material_idx];
+    if (!mat->is_emissive())
+      continue;
+
+    const intersection_data &data = m_intersection_data[tri_idx];
+    const bool has_uvs = tri.uv_idx[0] != no_index;
+    const vec3 uv0 = has_uvs ? m_uvs[tri.uv_idx[0]] : vec3(0.0, 0.0, 0.0);
+    const vec3 uv1 = has_uvs ? m_uvs[tri.uv_idx[1]] : vec3(1.0, 0.0, 0.0);
+    const vec3 uv2 = has_uvs ? m_uvs[tri.uv_idx[2]] : vec3(0.0, 1.0, 0.0);
+    lights.add(light_list::emitter::triangle(m_positions[tri.position_idx[0]],
+                                             data.edge1, data.edge2,
+                                             uv0, uv1, uv2, mat),
+               this, tri_idx, model_matrix, outer_path);
+  }
+}
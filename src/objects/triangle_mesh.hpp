@@ -0,0 +1,74 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "bvh_node.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// A triangle mesh with shared, indexed vertex attributes. Each triangle only
+// stores indices into the mesh's arrays, and the mesh is its own BVH whose
+// leaves refer to ranges of m_triangles directly.
+struct triangle_mesh : public hittable {
+  // Marks a missing normal or uv index
+  static constexpr uint32_t no_index = UINT32_MAX;
+
+  struct mesh_triangle {
+    uint32_t position_idx[3];
+    uint32_t normal_idx[3];
+    uint32_t uv_idx[3];
+    uint32_t material_idx;
+  };
+
+  // The edges from a triangle's first corner to the other two, precomputed
+  // once. The corner itself and the normal are rebuilt from m_positions, so
+  // that meshes don't hold a second copy of their vertices.
+  struct intersection_data {
+    vec3 edge1, edge2;
+  };
+
+  std::vector<point3> m_positions;
+  std::vector<vec3> m_normals;
+  std::vector<vec3> m_uvs;
+  std::vector<material *> m_materials;
+  std::vector<mesh_triangle> m_triangles;
+  // Parallel to m_triangles
+  std::vector<intersection_data> m_intersection_data;
+  std::vector<bvh_node> m_nodes;
+  size_t m_max_depth = 0;
+
+  static constexpr size_t max_stack_depth = 64;
+  static constexpr size_t max_triangles_per_leaf = 4;
+
+public:
+  triangle_mesh(std::vector<point3> &&positions, std::vector<vec3> &&normals,
+                std::vector<vec3> &&uvs, std::vector<material *> &&materials,
+                std::vector<mesh_triangle> &&triangles);
+
+  virtual ~triangle_mesh() {}
+
+  constexpr size_t size() const { return m_triangles.size(); }
+
+  virtual bool hit(const ray &r, const real t_min, const real t_max,
+                   hit_record &rec) const override;
+  virtual bool occluded(const ray &r, const real t_min,
+                        const real t_max) const override;
+  virtual void
+  compute_surface_interaction(const ray &r, hit_record &rec,
+                              const size_t path_idx) const override;
+  virtual void
+  gather_lights(light_list &lights, const mat4 &model_matrix,
+                std::vector<hit_record::path_entry> &outer_path) const override;
+  virtual bool bounding_box(const real time0, const real time1,
+                            aabb &output_box) const override {
+    if (m_nodes.empty())
+      return false;
+    output_box = m_nodes[0].bounding_box();
+    return true;
+  }
+
+private:
+  void build();
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "util.hpp"
+
+#include <array>
+#include <cstdint>
+#include <utility>
+
+// Hands out the random numbers for one pixel sample, one dimension at a time.
+// Every consumer of a path (pixel jitter, lens, time, each bounce, ...) takes
+// its dimensions in a fixed order, so a sampler can correlate the same
+// dimension across the samples of a pixel.
+struct sampler {
+  virtual ~sampler() = default;
+
+  // Starts the sample_idx-th sample of pixel pixel_idx from its first
+  // dimension
+  virtual void start_pixel_sample(const uint64_t pixel_idx,
+                                  const uint64_t sample_idx) = 0;
+
+  virtual real get_1d() = 0;
+  virtual std::pair<real, real> get_2d() = 0;
+};
+
+// Independent uniform random numbers from the counter-based rng
+struct random_sampler : public sampler {
+  rng m_rng = rng(0, 0);
+
+  virtual ~random_sampler() = default;
+
+  virtual void start_pixel_sample(const uint64_t pixel_idx,
+                                  const uint64_t sample_idx) override {
+    m_rng = rng(pixel_idx, sample_idx);
+  }
+
+  virtual real get_1d() override { return m_rng.next_real(); }
+  virtual std::pair<real, real> get_2d() override {
+    const real x = m_rng.next_real();
+    const real y = m_rng.next_real();
+    return std::make_pair(x, y);
+  }
+};
+
+// The first four dimensions of the Sobol sequence, shuffled and Owen-scrambled
+// per pixel with the hash-based scheme of "Practical Hash-based Owen
+// Scrambling" (Burley, 2020). Later dimensions are padded with further
+// independently scrambled copies of the same four dimensions, and a 2D
+// request never straddles two of these copies.
+struct sobol_sampler : public sampler {
+  static constexpr uint32_t dimensions_per_group = 4;
+
+  uint32_t m_index = 0;
+  uint32_t m_pixel_seed = 0;
+  uint32_t m_dimension = 0;
+  uint32_t m_group = UINT32_MAX;
+  std::array<uint32_t, dimensions_per_group> m_point = {};
+
+  virtual ~sobol_sampler() = default;
+
+  virtual void start_pixel_sample(const uint64_t pixel_idx,
+                                  const uint64_t sample_idx) override {
+    m_index = static_cast<uint32_t>(sample_idx);
+    m_pixel_seed = static_cast<uint32_t>(rng::mix(pixel_idx));
+    m_dimension = 0;
+    m_group = UINT32_MAX;
+  }
+
+  virtual real get_1d() override { return to_real(next_dimension()); }
+
+  virtual std::pair<real, real> get_2d() override {
+    if (m_dimension % dimensions_per_group == dimensions_per_group - 1)
+      m_dimension++;
+    const real x = to_real(next_dimension());
+    const real y = to_real(next_dimension());
+    return std::make_pair(x, y);
+  }
+
+  // Joe and Kuo's direction numbers for the first four Sobol dimensions
+  static constexpr auto directions = [] {
+    struct polynomial {
+      uint32_t degree, coefficients, initial[3];
+    };
+    constexpr polynomial polynomials[dimensions_per_group - 1] = {
+        {1, 0, {1, 0, 0}}, {2, 1, {1, 3, 0}}, {3, 1, {1, 3, 1}}};
+
+    std::array<std::array<uint32_t, 32>, dimensions_per_group> result = {};
+    // The first dimension is the van der Corput sequence
+    for (uint32_t bit = 0; bit < 32; ++bit)
+      result[0][bit] = 1u << (31 - bit);
+    for (uint32_t dim = 1; dim < dimensions_per_group; ++dim) {
+      const polynomial &p = polynomials[dim - 1];
+      std::array<uint32_t, 32> &v = result[dim];
+      for (uint32_t bit = 0; bit < p.degree; ++bit)
+        v[bit] = p.initial[bit] << (31 - bit);
+      for (uint32_t bit = p.degree; bit < 32; ++bit) {
+        v[bit] = v[bit - p.degree] ^ (v[bit - p.degree] >> p.degree);
+        for (uint32_t k = 1; k < p.degree; ++k)
+          if ((p.coefficients >> (p.degree - 1 - k)) & 1)
+            v[bit] ^= v[bit - k];
+      }
+    }
+    return result;
+  }();
+
+  // The contribution of each value of each byte of an index to its point, so
+  // that a point is the XOR of four table entries
+  static constexpr auto byte_tables = [] {
+    std::array<std::array<std::array<uint32_t, dimensions_per_group>, 256>, 4>
+        result = {};
+    for (uint32_t byte = 0; byte < 4; ++byte)
+      for (uint32_t value = 0; value < 256; ++value)
+        for (uint32_t bit = 0; bit < 8; ++bit)
+          if ((value >> bit) & 1)
+            for (uint32_t dim = 0; dim < dimensions_per_group; ++dim)
+              result[byte][value][dim] ^= directions[dim][8 * byte + bit];
+    return result;
+  }();
+
+  // All dimensions of the index-th point at once
+  static constexpr std::array<uint32_t, dimensions_per_group>
+  sobol(const uint32_t index) {
+    std::array<uint32_t, dimensions_per_group> result = {};
+    for (uint32_t byte = 0; byte < 4; ++byte) {
+      const auto &entry = byte_tables[byte][(index >> (8 * byte)) & 0xff];
+      for (uint32_t dim = 0; dim < dimensions_per_group; ++dim)
+        result[dim] ^= entry[dim];
+    }
+    return result;
+  }
+
+  static constexpr uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    return __builtin_bswap32(x);
+  }
+
+  // A hash in which every bit only depends on the bits below it, so that
+  // applying it to reversed bits gives a nested uniform (Owen) scramble
+  static constexpr uint32_t laine_karras_permutation(uint32_t x,
+                                                     const uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+  }
+
+  static constexpr uint32_t nested_uniform_scramble(const uint32_t x,
+                                                    const uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+  }
+
+  static constexpr uint32_t hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+  }
+
+  static constexpr uint32_t hash_combine(const uint32_t seed,
+                                         const uint32_t v) {
+    return seed ^ (v + (seed << 6) + (seed >> 2));
+  }
+
+private:
+  inline uint32_t next_dimension() {
+    const uint32_t group = m_dimension / dimensions_per_group;
+    if (group != m_group) {
+      // Each group of dimensions shuffles the samples and scrambles each
+      // dimension with its own seeds
+      const uint32_t seed = hash_combine(m_pixel_seed, hash(group));
+      m_point = sobol(nested_uniform_scramble(m_index, seed));
+      for (uint32_t dim = 0; dim < dimensions_per_group; ++dim)
+        m_point[dim] = nested_uniform_scramble(m_point[dim],
+                                               hash_combine(seed, hash(dim)));
+      m_group = group;
+    }
+    return m_point[m_dimension++ % dimensions_per_group];
+  }
+
+  // Keeps only as many bits as real can represent exactly, so that the result
+  // never rounds up to 1
+  static constexpr real to_real(const uint32_t x) {
+    constexpr int bits = std::min(std::numeric_limits<real>::digits, 32);
+    constexpr real scale = 1.0 / static_cast<real>(1ull << bits);
+    return static_cast<real>(x >> (32 - bits)) * scale;
+  }
+};
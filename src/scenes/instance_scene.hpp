@@ -10,26 +10,35 @@
 #include "hittable_list.hpp"
 #include "material.hpp"
 #include "material_manager.hpp"
+#include "mbvh.hpp"
 #include "obj_loader.hpp"
 #include "sphere.hpp"
+#include "tlas.hpp"
 #include "transformed_hittable.hpp"
 #include "triangle.hpp"
 
 #include "scene.hpp"
 
-inline auto instance_scene() {
+// How instance_scene places its geese: as instances of one shared BLAS in a
+// tlas, or as one transformed_hittable each in a 4 or 8 wide mbvh
+enum class instancing { tlas, mbvh4, mbvh8 };
+
+inline auto instance_scene(const instancing structure = instancing::tlas) {
   // Image
   const real aspect_ratio = 2.0;
   const int image_width = 1200;
   const int image_height = image_width / aspect_ratio;
 
-  hittable_list world;
+  hittable_list list;
 
   const auto ground_material =
       material_manager::create<lambertian>(colour(0.03, 0.10, 0.03));
-  world.emplace_back<sphere>(point3(0, -1000, 0), 1000, ground_material);
+  list.emplace_back<sphere>(point3(0, -1000, 0), 1000, ground_material);
 
+  // Every goose shares the same mesh, so only its transform is per instance
   const auto goose_obj = load_obj("res/obj/goose/goose.obj");
+  const auto geese = std::make_shared<tlas<triangle_mesh>>();
+  hittable_list transformed_geese;
   const int spread = 30;
   const int spacing = 3;
   for (int i = -spread; i <= spread; i += spacing) {
@@ -42,11 +51,21 @@ inline auto instance_scene() {
                      glm::scale(mat4(1.0), vec3(0.06)) *
                      glm::rotate(mat4(1.0), util::degrees_to_radians(angle),
                                  vec3(0, 1, 0));
-      world.emplace_back<transformed_hittable>(goose_obj, m);
+      if (structure == instancing::tlas)
+        geese->add_instance(goose_obj, m);
+      else
+        transformed_geese.emplace_back<transformed_hittable>(goose_obj, m);
     }
   }
 
-  auto list = hittable_list(std::make_shared<bvh<>>(world, 0.0, 1.0));
+  if (structure == instancing::tlas) {
+    geese->build();
+    list.add(geese);
+  } else if (structure == instancing::mbvh4) {
+    list.add(std::make_shared<mbvh<4>>(transformed_geese, 0.0, 1.0));
+  } else {
+    list.add(std::make_shared<mbvh<8>>(transformed_geese, 0.0, 1.0));
+  }
   list.add_background_map("res/hdr_pack/5.hdr");
 
   // Camera
@@ -1,14 +1,16 @@
-
 #pragma once
 
 #include "camera.hpp"
 #include "hittable.hpp"
 #include "hittable_list.hpp"
+#include "light_list.hpp"
 
 struct scene {
   hittable_list objects;
   camera cam;
+  // Gathered from objects, which must not change afterwards
+  light_list lights;
 
   scene(const hittable_list &objects, const camera &cam)
-      : objects(objects), cam(cam) {}
+      : objects(objects), cam(cam), lights(this->objects) {}
 };
@@ -1,11 +1,14 @@
 
 #pragma once
 
-#include "image.hpp"
+#include "mipmap.hpp"
 #include "util.hpp"
 
 struct texture {
-  virtual colour value(const real u, const real v, const point3 &p) const = 0;
+  // The texture at (u, v) or p, filtered over a square footprint wide in uv
+  // units, or point sampled when footprint is zero
+  virtual colour value(const real u, const real v, const point3 &p,
+                       const real footprint = 0.0) const = 0;
 };
 
 struct solid_colour : public texture {
@@ -16,21 +19,21 @@ struct solid_colour : public texture {
       : m_colour(r, g, b) {}
   virtual ~solid_colour() = default;
 
-  virtual inline colour value(const real u, const real v,
-                              const vec3 &p) const override {
+  virtual inline colour value(const real u, const real v, const vec3 &p,
+                              const real footprint = 0.0) const override {
     return m_colour;
   }
 };
 
 struct image_texture : public texture {
-  const image m_image;
+  const mipmap m_mipmap;
 
   explicit image_texture(const std::string_view &filename)
-      : m_image(filename) {}
+      : m_mipmap(filename) {}
   virtual ~image_texture() = default;
 
-  virtual inline colour value(const real u, const real v,
-                              const vec3 &p) const override {
-    return m_image.get_interpolated(u, v);
+  virtual inline colour value(const real u, const real v, const vec3 &p,
+                              const real footprint = 0.0) const override {
+    return m_mipmap.lookup(u, v, footprint);
   }
 };
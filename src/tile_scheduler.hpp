@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+// One pass of tile_weight samples per pixel over one tile of the image,
+// starting at sample sample_idx
+struct tile_task {
+  int tile_row, tile_col, tile_height, tile_width, sample_idx, tile_weight;
+  int tile_idx, pass_idx;
+};
+
+// One render thread per hardware thread, unless told otherwise
+inline int default_num_threads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Interleaves the bits of x and y, so that visiting a grid in increasing
+// order of the result walks it along a Z-order curve
+constexpr inline uint32_t morton_code(const uint32_t x, const uint32_t y) {
+  const auto spread = [](uint32_t v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+// Hands out the passes over every tile of an image to a fixed set of workers.
+// Each worker owns a deque of tasks, seeded with a contiguous run of the tiles
+// in Z-order so that neighbouring tiles share cache, and steals from the
+// others once its own deque runs dry.
+//
+// A tile's next pass is only queued once its previous pass has been handed
+// out, to the back of the deque of the worker that took it. A worker merging
+// a pass can therefore only ever wait on a pass that is already in progress,
+// so the ordered merges in render can't deadlock however tasks are stolen.
+//
+// Tiles can be retired early, once they have converged, and the whole
+// schedule can be cut short by stop() or by running out of sample_budget,
+// the total number of samples over all pixels. Passes which were already
+// handed out are always finished. Tiles which are still going once they have
+// samples_per_pixel samples get extra passes, up to max_samples_per_pixel,
+// which are held back and handed out a round at a time whenever the deques
+// run dry, so that the budget left by retired tiles is shared evenly between
+// the others.
+//
+// A resumed render passes the number of samples each tile already has, in
+// start_samples, and carries on from there.
+class tile_scheduler {
+  // Padded to a cache line, so that workers polling their own deques don't
+  // contend with each other
+  struct alignas(64) worker_queue {
+    std::mutex mutex;
+    std::deque<tile_task> tasks;
+  };
+
+  std::vector<worker_queue> m_queues;
+  std::vector<std::atomic<bool>> m_retired;
+  int m_samples_per_pixel, m_max_samples_per_pixel;
+  int m_tile_weight;
+  long long m_sample_budget;
+  // Extra passes waiting for the next round
+  std::mutex m_deferred_mutex;
+  std::vector<tile_task> m_deferred;
+  // The number of tasks that will be handed out if nothing else is retired
+  // and no extra passes are queued
+  std::atomic<int> m_num_tasks;
+  std::atomic<int> m_num_handed_out = 0;
+  // The number of tasks waiting in any deque or for the next round. Taking a
+  // task queues its next pass before this is decremented, so it only reaches
+  // 0 once every pass has been handed out.
+  std::atomic<int> m_num_queued;
+  std::atomic<long long> m_samples_handed_out = 0;
+  std::atomic<bool> m_stopped = false;
+
+public:
+  tile_scheduler(const int image_width, const int image_height,
+                 const int tile_width, const int tile_height,
+                 const int samples_per_pixel, const int tile_weight,
+                 const int num_workers, const int max_samples_per_pixel = 0,
+                 const long long sample_budget =
+                     std::numeric_limits<long long>::max(),
+                 const std::vector<int> &start_samples = {})
+      : m_queues(num_workers), m_samples_per_pixel(samples_per_pixel),
+        m_max_samples_per_pixel(
+            std::max(samples_per_pixel, max_samples_per_pixel)),
+        m_tile_weight(tile_weight), m_sample_budget(sample_budget) {
+    const int tiles_x = (image_width + tile_width - 1) / tile_width;
+    const int tiles_y = (image_height + tile_height - 1) / tile_height;
+    const int num_tiles = tiles_x * tiles_y;
+    m_retired = std::vector<std::atomic<bool>>(num_tiles);
+    m_num_tasks = 0;
+    m_num_queued = 0;
+
+    std::vector<int> order(num_tiles);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [tiles_x](const int a, const int b) {
+      return morton_code(a % tiles_x, a / tiles_x) <
+             morton_code(b % tiles_x, b / tiles_x);
+    });
+
+    std::vector<tile_task> tasks;
+    for (int idx = 0; idx < num_tiles; ++idx) {
+      const int tile_idx = order[idx];
+      const int tile_row = (tile_idx / tiles_x) * tile_height;
+      const int tile_col = (tile_idx % tiles_x) * tile_width;
+      const int sample_idx =
+          start_samples.empty() ? 0 : start_samples[tile_idx];
+      const tile_task task = {tile_row,
+                              tile_col,
+                              std::min(image_height - tile_row, tile_height),
+                              std::min(image_width - tile_col, tile_width),
+                              sample_idx,
+                              pass_weight(sample_idx),
+                              tile_idx,
+                              0};
+      m_samples_handed_out += static_cast<long long>(task.tile_width) *
+                              task.tile_height * sample_idx;
+      m_num_tasks += num_passes_left(sample_idx);
+      if (sample_idx >= m_max_samples_per_pixel)
+        continue;
+      ++m_num_queued;
+      if (sample_idx < m_samples_per_pixel)
+        tasks.push_back(task);
+      else
+        m_deferred.push_back(task);
+    }
+    distribute(tasks);
+  }
+
+  inline int num_tasks() const { return m_num_tasks; }
+  inline int num_handed_out() const { return m_num_handed_out; }
+
+  // Hands out no more passes over the given tile
+  inline void retire(const int tile_idx) {
+    m_retired[tile_idx].store(true, std::memory_order_relaxed);
+  }
+
+  // Hands out no more tasks at all
+  inline void stop() { m_stopped.store(true, std::memory_order_relaxed); }
+
+  // Returns true and sets task to the next task for the given worker, or
+  // returns false once there is nothing left to hand out
+  bool next(const int worker_idx, tile_task &task) {
+    const int num_workers = m_queues.size();
+    while (!m_stopped.load(std::memory_order_relaxed) &&
+           m_num_queued.load(std::memory_order_acquire) > 0) {
+      // Take the oldest task from our own deque, or else from the first other
+      // worker with any left
+      for (int offset = 0; offset < num_workers; ++offset) {
+        if (!pop_front((worker_idx + offset) % num_workers, task))
+          continue;
+        if (m_retired[task.tile_idx].load(std::memory_order_relaxed)) {
+          // Nothing depends on a pass which was never handed out
+          m_num_tasks -= num_passes_left(task.sample_idx);
+          m_num_queued.fetch_sub(1, std::memory_order_acq_rel);
+          continue;
+        }
+        const long long samples =
+            static_cast<long long>(task.tile_width) * task.tile_height *
+            task.tile_weight;
+        if (m_samples_handed_out.fetch_add(samples) + samples >
+            m_sample_budget) {
+          stop();
+          m_num_queued.fetch_sub(1, std::memory_order_acq_rel);
+          return false;
+        }
+        queue_next_pass(worker_idx, task);
+        m_num_handed_out.fetch_add(1, std::memory_order_relaxed);
+        m_num_queued.fetch_sub(1, std::memory_order_acq_rel);
+        return true;
+      }
+      // Either the remaining tasks are about to be queued by workers which
+      // have just taken their previous passes, or it's time for a round of
+      // extra passes
+      if (!start_next_round())
+        std::this_thread::yield();
+    }
+    return false;
+  }
+
+private:
+  // The number of samples per pixel in the pass starting at sample_idx
+  inline int pass_weight(const int sample_idx) const {
+    const int end_idx = sample_idx < m_samples_per_pixel
+                            ? m_samples_per_pixel
+                            : m_max_samples_per_pixel;
+    return std::min(end_idx - sample_idx, m_tile_weight);
+  }
+
+  // The number of passes a tile needs to get from sample_idx to
+  // samples_per_pixel, not counting extra passes
+  inline int num_passes_left(const int sample_idx) const {
+    return std::max(0, m_samples_per_pixel - sample_idx + m_tile_weight - 1) /
+           m_tile_weight;
+  }
+
+  bool pop_front(const int worker_idx, tile_task &task) {
+    worker_queue &queue = m_queues[worker_idx];
+    std::lock_guard<std::mutex> guard(queue.mutex);
+    if (queue.tasks.empty())
+      return false;
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+  }
+
+  // Splits tasks into contiguous runs, one at the back of each worker's deque
+  void distribute(const std::vector<tile_task> &tasks) {
+    const size_t num_workers = m_queues.size();
+    for (size_t idx = 0; idx < tasks.size(); ++idx) {
+      const size_t worker_idx = idx * num_workers / tasks.size();
+      worker_queue &queue = m_queues[worker_idx];
+      std::lock_guard<std::mutex> guard(queue.mutex);
+      queue.tasks.push_back(tasks[idx]);
+    }
+  }
+
+  bool start_next_round() {
+    std::vector<tile_task> round;
+    {
+      std::lock_guard<std::mutex> guard(m_deferred_mutex);
+      round.swap(m_deferred);
+    }
+    if (round.empty())
+      return false;
+    distribute(round);
+    return true;
+  }
+
+  void queue_next_pass(const int worker_idx, const tile_task &task) {
+    const int sample_idx = task.sample_idx + task.tile_weight;
+    if (sample_idx >= m_max_samples_per_pixel)
+      return;
+    if (m_retired[task.tile_idx].load(std::memory_order_relaxed)) {
+      m_num_tasks -= num_passes_left(sample_idx);
+      return;
+    }
+    tile_task next = task;
+    next.sample_idx = sample_idx;
+    next.tile_weight = pass_weight(sample_idx);
+    next.pass_idx = task.pass_idx + 1;
+
+    m_num_queued.fetch_add(1, std::memory_order_acq_rel);
+    if (sample_idx >= m_samples_per_pixel) {
+      m_num_tasks.fetch_add(1, std::memory_order_relaxed);
+      std::lock_guard<std::mutex> guard(m_deferred_mutex);
+      m_deferred.push_back(next);
+      return;
+    }
+    worker_queue &queue = m_queues[worker_idx];
+    std::lock_guard<std::mutex> guard(queue.mutex);
+    queue.tasks.push_back(next);
+  }
+};
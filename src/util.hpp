@@ -5,6 +5,8 @@
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <ctime>
 #include <iostream>
 #include <limits>
 #include <memory>
@@ -14,7 +16,6 @@
 
 #include <boost/assert.hpp>
 #include <boost/random.hpp>
-#include <boost/random/sobol.hpp>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -64,6 +65,37 @@ constexpr real inf = std::numeric_limits<real>::infinity();
 constexpr real pi = 3.1415926535897932385;
 constexpr real eps = 0.001;
 
+// A counter-based random number generator. The i-th number of the stream
+// keyed by (pixel, sample) is a hash of the key and i, so every sample sees
+// the same numbers no matter which thread renders it, or when.
+struct rng {
+  uint64_t m_key;
+  uint64_t m_counter = 0;
+
+  // The SplitMix64 finalizer, which maps consecutive inputs to independent
+  // looking outputs
+  static constexpr uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  constexpr rng(const uint64_t pixel_idx, const uint64_t sample_idx)
+      : m_key(mix(mix(pixel_idx) + sample_idx)) {}
+
+  constexpr inline uint64_t next_uint() {
+    return mix(m_key + (++m_counter) * 0x9e3779b97f4a7c15ull);
+  }
+
+  // Returns a real in [0, 1), using only as many bits as real can represent
+  // exactly so that the result never rounds up to 1
+  constexpr inline real next_real() {
+    constexpr int mantissa_bits = std::numeric_limits<real>::digits;
+    constexpr real scale = 1.0 / static_cast<real>(1ull << mantissa_bits);
+    return static_cast<real>(next_uint() >> (64 - mantissa_bits)) * scale;
+  }
+};
+
 // Utility Functions
 
 namespace util {
@@ -71,10 +103,13 @@ constexpr inline real degrees_to_radians(const real degrees) {
   return degrees * pi / 180.0;
 }
 
+// Each thread has its own generator, for setting up scenes. Rendering draws
+// its numbers from a sampler instead.
 inline real random_real() {
   // return rand() / (RAND_MAX + 1.0);
-  static boost::random::uniform_real_distribution<real> distribution(0.0, 1.0);
-  static boost::random::taus88 generator(127);
+  thread_local boost::random::uniform_real_distribution<real> distribution(
+      0.0, 1.0);
+  thread_local boost::random::taus88 generator(127);
   return distribution(generator);
 }
 
@@ -100,18 +135,12 @@ inline long long get_time_ms() {
       .count();
 }
 
-inline auto get_sobol_sequence(const size_t dimensions,
-                               const size_t num_samples) {
-  boost::random::sobol generator(dimensions);
-  boost::random::uniform_real_distribution<real> uni_dist(0.0, 1.0);
-  boost::variate_generator<boost::random::sobol &,
-                           boost::random::uniform_real_distribution<real>>
-      uni(generator, uni_dist);
-
-  std::vector<std::pair<real, real>> result(num_samples);
-  for (size_t i = 0; i < num_samples; ++i)
-    result[i] = std::make_pair(uni(), uni());
-  return result;
+// CPU time consumed by the calling thread, which unlike wall time does not
+// count time spent descheduled
+inline long long get_thread_time_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 inline constexpr size_t largest_axis(const vec3 &v) {
@@ -131,28 +160,92 @@ inline vec3 random_vec3(const real min, const real max) {
               random_real(min, max));
 }
 
-inline vec3 random_in_unit_disk() {
-  while (true) {
-    const vec3 p = vec3(random_real(-1.0, 1.0), random_real(-1.0, 1.0), 0.0);
-    if (glm::dot(p, p) <= 1.0)
-      return p;
-  }
+// Maps a uniform 2D sample to the unit disk in the xy-plane with Shirley and
+// Chiu's concentric mapping, which keeps stratified samples stratified
+inline vec3 sample_unit_disk(const real u1, const real u2) {
+  const real x = 2.0 * u1 - 1.0, y = 2.0 * u2 - 1.0;
+  if (x == 0.0 && y == 0.0)
+    return vec3(0.0);
+  const bool use_x = std::abs(x) > std::abs(y);
+  const real r = use_x ? x : y;
+  const real theta =
+      use_x ? (pi / 4.0) * (y / x) : (pi / 2.0) - (pi / 4.0) * (x / y);
+  return vec3(r * std::cos(theta), r * std::sin(theta), 0.0);
 }
 
-inline vec3 random_in_unit_sphere() {
-  while (true) {
-    const vec3 p = random_vec3(-1.0, 1.0);
-    if (glm::dot(p, p) <= 1.0)
-      return p;
-  }
+// Maps a uniform 2D sample to a uniformly distributed unit vector
+inline vec3 sample_unit_vector(const real u1, const real u2) {
+  const real z = 1.0 - 2.0 * u1;
+  const real r = std::sqrt(std::max<real>(0.0, 1.0 - z * z));
+  const real phi = 2.0 * pi * u2;
+  return vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
-inline vec3 random_unit_vector() {
-  return glm::normalize(random_in_unit_sphere());
+// Maps a uniform 3D sample to the unit ball
+inline vec3 sample_unit_ball(const real u1, const real u2, const real u3) {
+  return std::cbrt(u3) * sample_unit_vector(u1, u2);
+}
+
+// Completes the unit vector n to an orthonormal basis (Duff et al., 2017)
+inline void orthonormal_basis(const vec3 &n, vec3 &b1, vec3 &b2) {
+  const real sign = std::copysign(real(1.0), n.z);
+  const real a = -1.0 / (sign + n.z);
+  const real b = n.x * n.y * a;
+  b1 = vec3(1.0 + sign * n.x * n.x * a, sign * b, -sign * n.x);
+  b2 = vec3(b, sign + n.y * n.y * a, -n.y);
+}
+
+// The multiple importance sampling weight for a sample drawn with density
+// f_pdf, when g_pdf is the density another strategy would have drawn it with
+inline real power_heuristic(const real f_pdf, const real g_pdf) {
+  const real f = f_pdf * f_pdf, g = g_pdf * g_pdf;
+  return f / (f + g);
 }
 
 inline constexpr bool near_zero(const vec3 &v) {
   return glm::dot(v, v) < eps * eps;
 }
 
+// A bound on the relative rounding error of n consecutive floating-point
+// operations. See section 3.9 of Physically Based Rendering (3rd edition).
+inline constexpr real gamma(const int n) {
+  constexpr real machine_eps = std::numeric_limits<real>::epsilon() * 0.5;
+  return (n * machine_eps) / (1 - n * machine_eps);
+}
+
+// Moves a hit point p, whose coordinates are each within p_error of the true
+// surface, far enough along the unit geometric normal n to be strictly on the
+// side that n points to
+inline point3 offset_ray_origin(const point3 &p, const vec3 &p_error,
+                                const vec3 &n) {
+  const real distance = glm::dot(glm::abs(n), p_error);
+  const vec3 offset = distance * n;
+  point3 result = p + offset;
+  // Round away from p, since the addition above may have rounded towards it
+  for (int axis = 0; axis < 3; ++axis) {
+    if (offset[axis] > 0)
+      result[axis] = std::nextafter(result[axis],
+                                    std::numeric_limits<real>::max());
+    else if (offset[axis] < 0)
+      result[axis] = std::nextafter(result[axis],
+                                    std::numeric_limits<real>::lowest());
+  }
+  return result;
+}
+
+// Bounds the error in m * p, given that p is within p_error of the true point
+inline vec3 transformed_point_error(const mat4 &m, const point3 &p,
+                                    const vec3 &p_error) {
+  vec3 result;
+  for (int row = 0; row < 3; ++row) {
+    real rounding = std::abs(m[3][row]), propagated = 0;
+    for (int col = 0; col < 3; ++col) {
+      rounding += std::abs(m[col][row] * p[col]);
+      propagated += std::abs(m[col][row]) * p_error[col];
+    }
+    result[row] = gamma(3) * rounding + (1 + gamma(3)) * propagated;
+  }
+  return result;
+}
+
 }; // namespace util